@@ -1,9 +1,11 @@
 #include <stdio.h>
+#include <io.h>
 //#define MINIZ_HEADER_FILE_ONLY
 #include "miniz.c"
 
 #define fprintf(...) ((void)0)
 #include "zopfli\zlib_container.h"
+#include "zopfli\arena.c"
 #include "zopfli\blocksplitter.c"
 #include "zopfli\cache.c"
 #include "zopfli\hash.c"
@@ -15,102 +17,269 @@
 #include "zopfli\tree.c"
 #include "zopfli\util.c"
 #include "zopfli\zlib_container.c"
+//只屏蔽zopfli的输出，后面写清单文件还要用fprintf
+#undef fprintf
 
 
 Options options;
 
-unsigned long CRC32_MEM(const unsigned char* InStr, unsigned long len)
+//超过MAX_PATH的路径要加上\\?\前缀才能使用，CreateDirectory还要再留出12个字符。
+//把dir和name连接起来（name为0时只复制dir），需要时加上前缀，返回的字符串用free释放
+wchar_t *MakePath(const wchar_t *dir, const wchar_t *name)
 {
-	//生成Crc32的查询表
-	unsigned int Crc32Table[256] = {0};
-	unsigned int Crc;
-	for (unsigned int i = 0; i < 256; i++)
-	{
-		Crc = i;
-		for (unsigned int j = 0; j < 8; j++)
-		{
-			if (Crc & 1)
-				Crc = (Crc >> 1) ^ 0xEDB88320;
-			else
-				Crc >>= 1;
-		}
-		Crc32Table[i] = Crc;
-	}
+    size_t dir_len = wcslen(dir);
+    bool slash = name && dir_len>0 && dir[dir_len-1]!='\\';
+    size_t len = dir_len + (name ? slash + wcslen(name) : 0);
+    wchar_t *path = (wchar_t *)malloc((len + 8)*sizeof(wchar_t));
+    path[0] = 0;
+    if(len>=MAX_PATH-12 && wcsncmp(dir, L"\\\\?\\", 4)!=0)
+    {
+        //\\server\share要写成\\?\UNC\server\share
+        if(wcsncmp(dir, L"\\\\", 2)==0)
+        {
+            wcscpy(path, L"\\\\?\\UNC");
+            dir++;
+        }
+        else
+        {
+            wcscpy(path, L"\\\\?\\");
+        }
+    }
+    wcscat(path, dir);
+    if(name)
+    {
+        if(slash) wcscat(path, L"\\");
+        wcscat(path, name);
+    }
+    return path;
+}
 
-	//开始计算CRC32校验值
-	Crc = 0xFFFFFFFF;
+//去掉MakePath加上的前缀。\\?\UNC\server\share只剩server\share，开头的\要另外处理
+const wchar_t *PlainPath(const wchar_t *path)
+{
+    if(wcsncmp(path, L"\\\\?\\UNC\\", 8)==0) return path + 8;
+    if(wcsncmp(path, L"\\\\?\\", 4)==0) return path + 4;
+    return path;
+}
 
-	//IDAT
-	for (unsigned int i = 0; i < 4; i++)
-	{
-		Crc = (Crc >> 8) ^ Crc32Table[(Crc & 0xFF) ^ "IDAT"[i]];
-	}
+//只读映射整个文件，失败时返回0。用UnmapViewOfFile释放
+const BYTE *MapFileReadOnly(const wchar_t *file, DWORD *size)
+{
+    HANDLE fh = CreateFileW(file, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if(fh==INVALID_HANDLE_VALUE)
+    {
+        return 0;
+    }
+    *size = GetFileSize(fh, 0);
 
-	for (unsigned int i = 0; i < len; i++)
-	{
-		Crc = (Crc >> 8) ^ Crc32Table[(Crc & 0xFF) ^ InStr[i]];
-	}
+    //空文件无法映射；映射和视图各自保持文件打开，句柄可以立即关闭
+    HANDLE map = *size ? CreateFileMappingW(fh, 0, PAGE_READONLY, 0, 0, 0) : 0;
+    CloseHandle(fh);
+    if(!map)
+    {
+        return 0;
+    }
+    const BYTE *view = (const BYTE*)MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(map);
+    return view;
+}
 
-	Crc ^= 0xFFFFFFFF;
-	return Crc;
+//复制整个数据块（长度、类型、数据和CRC32），返回指向类型的指针
+BYTE *CopyChunk(BYTE *old, const BYTE *type, DWORD len)
+{
+    if(old)
+    {
+        free(old-4);
+    }
+    BYTE *chunk = (BYTE *)malloc(len+12);
+    memcpy(chunk, type-4, len+12);
+    return chunk+4;
 }
 
-void MinifyPNG(HWND list, const wchar_t *file, bool SaveBak)
+unsigned long long FileTimeValue(const FILETIME *t)
 {
-    ListBox_AddString(list, file);
+    return ((unsigned long long)t->dwHighDateTime<<32) | t->dwLowDateTime;
+}
 
-    FILE *fp = _wfopen(file, L"rb");
-    if(!fp)
+//文件的大小和修改时间
+bool GetFileStamp(const wchar_t *file, unsigned long long *size, unsigned long long *mtime)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if(!GetFileAttributesExW(file, GetFileExInfoStandard, &data))
     {
-        ListBox_AddString(list, L"打开文件失败。");
-        ListBox_AddString(list, L"");
-        return;
+        return false;
+    }
+    *size = ((unsigned long long)data.nFileSizeHigh<<32) | data.nFileSizeLow;
+    *mtime = FileTimeValue(&data.ftLastWriteTime);
+    return true;
+}
+
+//每个IDAT数据块最多存放的压缩数据，默认1MB，一般的图片仍然只有一个IDAT
+DWORD idat_chunk_size = 1<<20;
+
+//是否在压缩完整的文件里加上私有的数据块mpNG，记录压缩选项和IDAT的长度，下次用相同的选项处理时直接跳过。
+//第一、二个字母小写表示辅助、私有，第四个字母大写表示图像数据改变后其他程序不应该复制它
+bool mark_output = false;
+
+//大于0时先估计压缩后文件能减小的百分比，不到这个值的文件跳过
+double min_gain = 0;
+
+//不为0时，所有文件的压缩在这个时刻（GetSeconds）结束：正在压缩的文件用已经得到的最好结果，还没开始的不再压缩
+double deadline = 0;
+
+//是否把扫描行跨度和像素大小作为匹配距离提示。能快一些，但压缩后的文件一般会大一点，所以默认不用
+bool fast_hints = false;
+
+//影响压缩结果的选项的CRC32
+DWORD OptionsSignature()
+{
+    char sig[512];
+    sprintf(sig, "%d %d %d %d %lu %d %lu %d %d %d %d %d %d %d %g %g %g %lu %d",
+            options.numiterations, options.blocksplitting, options.blocksplittinglast, options.blocksplittingmax,
+            (unsigned long)options.masterblocksize, options.cachedlengths, (unsigned long)options.cachememory,
+            options.chainhits, options.samehash, options.shortcutrepetitions, options.lazymatching,
+            options.binarytree, options.hash4, options.convergenceiterations, options.convergencethreshold,
+            options.blocktimelimit, options.filetimelimit, (unsigned long)idat_chunk_size, (int)fast_hints);
+    return (DWORD)mz_crc32(MZ_CRC32_INIT, (const BYTE*)sig, strlen(sig));
+}
+
+//一个文件在读取、压缩、写入三个阶段之间传递的数据
+struct PNGJob
+{
+    const wchar_t *file;
+    DWORD FileLength;
+
+    //复制出来的IHDR和PLTE，指向数据块类型
+    BYTE *ihdr;
+    BYTE *plte;
+    DWORD ihdr_len;
+    DWORD plte_len;
+
+    //解压后的图像数据，压缩完就释放
+    BYTE *raw;
+    DWORD raw_len;
+
+    //压缩阶段写出的临时文件和它的长度，没有临时文件时t_file为0
+    wchar_t *t_file;
+    DWORD new_len;
+    CompressionStats stats;
+
+    //压缩进度，0到1
+    double progress;
+
+    //出错时的提示，0表示没有出错
+    const wchar_t *error;
+
+    //WritePNG给出处理后文件的大小和修改时间，finished表示处理完没有出错。want_crc为true时，ReadPNG和WritePNG还分别算出原文件和处理后文件的CRC32
+    bool want_crc;
+    DWORD crc;
+    bool finished;
+    unsigned long long out_size;
+    unsigned long long out_mtime;
+    DWORD out_crc;
+
+    //清单里记录的CRC32。has_known_crc为true时，原文件的内容和它相同就不再压缩，unchanged为true
+    DWORD known_crc;
+    bool has_known_crc;
+    bool unchanged;
+
+    //已经压缩得足够好的文件也不再压缩：optimal表示带有相同选项的mpNG标记，low_gain表示估计能减小的不到min_gain%，估计的文件长度是predicted_len
+    bool optimal;
+    bool low_gain;
+    DWORD predicted_len;
+
+    //开始压缩时已经过了deadline，没有压缩
+    bool out_of_time;
+};
+
+void InitPNGJob(PNGJob *job, const wchar_t *file)
+{
+    memset(job, 0, sizeof(*job));
+    job->file = file;
+    job->stats.stage = STAGE_COMPLETE;
+}
+
+void FreePNGJob(PNGJob *job)
+{
+    if(job->ihdr) free(job->ihdr-4);
+    if(job->plte) free(job->plte-4);
+    free(job->raw);
+    if(job->t_file)
+    {
+        DeleteFileW(job->t_file);
+        free(job->t_file);
     }
-    fseek( fp, 0, SEEK_END);
-    int FileLength = ftell(fp);
-    fseek( fp, 0, SEEK_SET);
+    job->ihdr = 0;
+    job->plte = 0;
+    job->raw = 0;
+    job->t_file = 0;
+}
 
-    BYTE *FileBuf = (BYTE*)malloc(FileLength);
-    fread(FileBuf,1,FileLength,fp);
-    fclose(fp);
+//读取阶段：映射输入文件，在原处解析数据块并解压图像数据，返回前解除映射
+bool ReadPNG(PNGJob *job)
+{
+    DWORD FileLength = 0;
+    const BYTE *FileBuf = MapFileReadOnly(job->file, &FileLength);
+    if(!FileBuf)
+    {
+        job->error = L"打开文件失败。";
+        return false;
+    }
+    job->FileLength = FileLength;
+
+    if(job->want_crc)
+    {
+        job->crc = (DWORD)mz_crc32(MZ_CRC32_INIT, FileBuf, FileLength);
+        if(job->has_known_crc && job->crc==job->known_crc)
+        {
+            //只是修改时间变了，内容还是上次处理后的样子
+            job->unchanged = true;
+            UnmapViewOfFile(FileBuf);
+            return true;
+        }
+    }
 
-    BYTE *ptr = FileBuf;
+    const BYTE *ptr = FileBuf;
+    const BYTE *end = FileBuf + FileLength;
 
     BYTE png_sig[] = {0x89,0x50,0x4e,0x47,0x0d,0x0a,0x1a,0x0a};
     if( FileLength<sizeof(png_sig) || memcmp(ptr,png_sig,sizeof(png_sig)) )
     {
-        ListBox_AddString(list, L"不是PNG文件。");
-        ListBox_AddString(list, L"");
-        free(FileBuf);
-        return;
+        job->error = L"不是PNG文件。";
+        UnmapViewOfFile(FileBuf);
+        return false;
     }
 
     ptr += sizeof(png_sig);
 
-    BYTE *ihdr = 0;
-    BYTE *plte = 0;
+    //IHDR和PLTE复制出来留到写文件时用，IDAT拼接起来
     BYTE *idat = 0;
-    DWORD ihdr_len = 0;
-    DWORD plte_len = 0;
     DWORD idat_len = 0;
-    while(ptr<FileBuf+FileLength)
+    bool marked = false;
+    DWORD marked_options = 0;
+    DWORD marked_idat_len = 0;
+    while(end-ptr>=12)
     {
-        DWORD len = __builtin_bswap32(*(DWORD*)ptr);
+        DWORD len = __builtin_bswap32(*(const DWORD*)ptr);
         ptr+=4;
 
+        if(len>(DWORD)(end-ptr)-8)
+        {
+            break; //截断的数据块
+        }
         if(memcmp(ptr,"IEND",4)==0)
         {
             break;
         }
         if(memcmp(ptr,"IHDR",4)==0)
         {
-            ihdr = ptr;
-            ihdr_len = len;
+            job->ihdr = CopyChunk(job->ihdr, ptr, len);
+            job->ihdr_len = len;
         }
         if(memcmp(ptr,"PLTE",4)==0)
         {
-            plte = ptr;
-            plte_len = len;
+            job->plte = CopyChunk(job->plte, ptr, len);
+            job->plte_len = len;
         }
         if(memcmp(ptr,"IDAT",4)==0)
         {
@@ -118,111 +287,533 @@ void MinifyPNG(HWND list, const wchar_t *file, bool SaveBak)
             memcpy(idat + idat_len, ptr+4,len);
             idat_len += len;
         }
+        if(memcmp(ptr,"mpNG",4)==0 && len==8)
+        {
+            marked = true;
+            marked_options = __builtin_bswap32(*(const DWORD*)(ptr+4));
+            marked_idat_len = __builtin_bswap32(*(const DWORD*)(ptr+8));
+        }
 
         ptr+=4; //
         ptr+=len;
         ptr+=4; //CRC32
     }
 
-    if(ihdr && idat)
+    UnmapViewOfFile(FileBuf);
+
+    if(!job->ihdr || job->ihdr_len<13 || !idat)
+    {
+        free(idat);
+        job->error = L"不是有效的PNG文件。";
+        return false;
+    }
+
+    //IDAT的长度也相同时，标记确实是给这些图像数据的，用相同的选项再压缩一遍结果也一样
+    if(marked && marked_idat_len==idat_len && marked_options==OptionsSignature())
+    {
+        free(idat);
+        job->optimal = true;
+        return true;
+    }
+
+    DWORD w = __builtin_bswap32(*(DWORD*)(job->ihdr+4));
+    DWORD h = __builtin_bswap32(*(DWORD*)(job->ihdr+8));
+
+    DWORD out_len = (w*4+1)*h*4;
+    BYTE *out_buf = (BYTE *)malloc(out_len);
+
+    int status = mz_uncompress(out_buf, &out_len, idat, idat_len);
+    free(idat);
+    if(status!=MZ_OK)
+    {
+        free(out_buf);
+        job->error = L"异常的PNG文件。";
+        return false;
+    }
+
+    job->raw = out_buf;
+    job->raw_len = out_len;
+    return true;
+}
+
+//写出的文件是否先刷到磁盘再替换原文件，断电时也不会留下不完整的PNG
+bool sync_output = false;
+
+//不为0时，备份放到这个目录下，按原文件的完整路径存放，而不是以_为前缀放在原文件旁边
+const wchar_t *backup_dir = 0;
+
+//创建path所在的各级目录。SHCreateDirectoryEx不支持长路径
+bool CreateParentDirs(wchar_t *path)
+{
+    wchar_t *last = wcsrchr(path, '\\');
+    if(!last || last==path || last[-1]==':' || last[-1]=='\\')
+    {
+        return true; //到了盘符或者路径开头
+    }
+    *last = 0;
+    DWORD attr = GetFileAttributesW(path);
+    bool ok;
+    if(attr!=INVALID_FILE_ATTRIBUTES)
+    {
+        ok = (attr & FILE_ATTRIBUTE_DIRECTORY)!=0;
+    }
+    else
+    {
+        ok = CreateParentDirs(path) && (CreateDirectoryW(path, 0) || GetLastError()==ERROR_ALREADY_EXISTS);
+    }
+    *last = '\\';
+    return ok;
+}
+
+//得到file的备份文件名，需要时创建它所在的目录。返回的字符串用free释放，失败时返回0
+wchar_t *GetBackupName(const wchar_t *file)
+{
+    const wchar_t *rest = PlainPath(file);
+    wchar_t *temp;
+    if(!backup_dir)
+    {
+        //\\?\UNC\server\share\b.png去掉前缀后，开头要补回两个反斜杠
+        bool unc = rest-file==8;
+        const wchar_t *ext = wcsrchr(rest,'\\');
+        ext = ext ? ext + 1 : rest;
+        temp = (wchar_t *)malloc((wcslen(rest)+4)*sizeof(wchar_t));
+        wcscpy(temp, unc ? L"\\\\" : L"");
+        wcsncat(temp, rest, ext-rest);
+        wcscat(temp, L"_");
+        wcscat(temp, ext);
+    }
+    else
+    {
+        //D:\a\b.png备份为backup_dir\D\a\b.png，\\server\share\b.png备份为backup_dir\server\share\b.png
+        while(*rest=='\\') rest++;
+        temp = (wchar_t *)malloc((wcslen(backup_dir)+wcslen(rest)+2)*sizeof(wchar_t));
+        wcscpy(temp, backup_dir);
+        wcscat(temp, L"\\");
+        size_t len = wcslen(temp);
+        for(; *rest; rest++)
+        {
+            if(*rest!=':') temp[len++] = *rest;
+        }
+        temp[len] = 0;
+    }
+
+    wchar_t *b_file = MakePath(temp, 0);
+    free(temp);
+    if(backup_dir && !CreateParentDirs(b_file))
+    {
+        free(b_file);
+        return 0;
+    }
+    return b_file;
+}
+
+bool SameVolume(const wchar_t *a, const wchar_t *b)
+{
+    wchar_t va[MAX_PATH];
+    wchar_t vb[MAX_PATH];
+    return GetVolumePathNameW(a, va, MAX_PATH) && GetVolumePathNameW(b, vb, MAX_PATH) && _wcsicmp(va, vb)==0;
+}
+
+//把zopfli逐块交出的压缩数据分成IDAT数据块写入文件，边接收边计算CRC32
+struct IDATWriter
+{
+    FILE *out;
+    BYTE *buf;
+    DWORD size;
+    mz_ulong crc;
+
+    //已经写出的文件长度，超过limit时新文件不可能更小，放弃压缩。data是其中压缩数据的长度
+    DWORD total;
+    DWORD data;
+    DWORD limit;
+    bool failed;
+
+    //因为超过limit放弃压缩时，stats在放弃之前达到的阶段，zopfli随后会把它改成STAGE_CANCELLED
+    const CompressionStats *stats;
+    CompressionStage stage;
+    bool full;
+};
+
+void FlushIDAT(IDATWriter *w)
+{
+    if(w->size==0 || w->failed)
+    {
+        return;
+    }
+    DWORD len = __builtin_bswap32(w->size);
+    DWORD crc = __builtin_bswap32((DWORD)w->crc);
+    fwrite(&len,1,4,w->out);
+    fwrite("IDAT",1,4,w->out);
+    fwrite(w->buf,1,w->size,w->out);
+    fwrite(&crc,1,4,w->out);
+    w->failed = ferror(w->out)!=0;
+    w->total += w->size+12;
+    w->size = 0;
+    w->crc = mz_crc32(MZ_CRC32_INIT, (const BYTE*)"IDAT", 4);
+}
+
+int IDATOutput(const unsigned char *data, size_t size, void *context)
+{
+    IDATWriter *w = (IDATWriter*)context;
+    while(size>0 && !w->failed)
+    {
+        DWORD n = idat_chunk_size - w->size;
+        if(n>size) n = (DWORD)size;
+        memcpy(w->buf+w->size, data, n);
+        w->crc = mz_crc32(w->crc, data, n);
+        w->size += n;
+        w->data += n;
+        data += n;
+        size -= n;
+        if(w->size==idat_chunk_size)
+        {
+            FlushIDAT(w);
+        }
+    }
+    if(!w->failed && !w->full && w->total+w->size>=w->limit)
+    {
+        w->full = true;
+        w->stage = w->stats->stage;
+    }
+    return w->failed || w->full;
+}
+
+//zlib数据有zlib_len字节时，CompressPNG写出的文件长度
+DWORD PNGLength(const PNGJob *job, size_t zlib_len)
+{
+    size_t len = 8 + job->ihdr_len+12 + (job->plte ? job->plte_len+12 : 0);
+    len += zlib_len + (zlib_len+idat_chunk_size-1)/idat_chunk_size*12;
+    len += (mark_output ? 20 : 0) + 12;
+    return (DWORD)len;
+}
+
+//估计压缩后文件能不能减小min_gain%，不能时返回true。先用miniz快速压缩一遍，已经减小得足够多时就不用再估计；
+//否则原文件可能已经被很好地压缩过，再用只迭代一次的zopfli估计，完整压缩保留最好的一次迭代，结果不会比它差
+bool LowGain(PNGJob *job, const Options *local)
+{
+    double limit = job->FileLength*(1-min_gain/100);
+
+    mz_ulong fast_len = mz_compressBound(job->raw_len);
+    BYTE *fast = (BYTE *)malloc(fast_len);
+    int status = fast ? mz_compress2(fast, &fast_len, job->raw, job->raw_len, MZ_UBER_COMPRESSION) : MZ_MEM_ERROR;
+    free(fast);
+    if(status==MZ_OK && PNGLength(job, fast_len)<=limit)
+    {
+        return false;
+    }
+
+    Options quick = *local;
+    quick.numiterations = 1;
+    quick.stats = 0;
+    quick.progress = 0;
+    quick.output = 0;
+    unsigned char *zopfli_buf = 0;
+    size_t zopfli_size = 0;
+    int error = ZlibCompress(&quick, job->raw, job->raw_len, &zopfli_buf, &zopfli_size);
+    free(zopfli_buf);
+    if(error)
+    {
+        return false; //留给完整的压缩报告错误
+    }
+    job->predicted_len = PNGLength(job, zopfli_size);
+    return job->predicted_len>limit;
+}
+
+//压缩阶段：用全局选项的副本压缩图像数据，可以在多个线程里同时进行。进度回调的context是job。
+//压缩数据不在内存里攒成整个IDAT，而是随压缩直接写进原文件所在目录的临时文件，由写入阶段决定是否替换原文件
+bool CompressPNG(PNGJob *job)
+{
+    if(job->unchanged || job->optimal)
+    {
+        return true;
+    }
+    if(deadline>0 && GetSeconds()>=deadline)
+    {
+        free(job->raw);
+        job->raw = 0;
+        job->out_of_time = true;
+        return true;
+    }
+
+    Options local = options;
+    local.stats = &job->stats;
+    local.progresscontext = job;
+
+    //全局的截止时间和每个文件的时间限制，取先到的一个
+    if(deadline>0)
+    {
+        local.filedeadline = deadline;
+        if(local.filetimelimit>0 && GetSeconds()+local.filetimelimit<deadline)
+        {
+            local.filedeadline = GetSeconds()+local.filetimelimit;
+        }
+    }
+
+    //扫描行跨度和像素大小，作为匹配距离提示（隔行扫描的图像不适用）
+    BYTE *ihdr = job->ihdr;
+    if(fast_hints && ihdr[16]==0)
     {
         DWORD w = __builtin_bswap32(*(DWORD*)(ihdr+4));
-        DWORD h = __builtin_bswap32(*(DWORD*)(ihdr+8));
-
-        DWORD out_len = (w*4+1)*h*4;
-        BYTE *out_buf = (BYTE *)malloc(out_len);
-
-        if(mz_uncompress(out_buf, &out_len, idat, idat_len)==MZ_OK)
-        {
-            free(idat);
-            //
-            ListBox_AddString(list, L"准备重新压缩。");
-
-            unsigned char *zopfli_buf = 0;
-            size_t zopfli_size = 0;
-            ZlibCompress(&options, out_buf, out_len, &zopfli_buf, &zopfli_size);
-            free(out_buf);
-
-            if(SaveBak)
-            {
-                wchar_t t_file[MAX_PATH];
-                wcscpy(t_file, file);
-
-                wchar_t *ext = wcsrchr(file,'\\') + 1;
-                t_file[ext-file] = 0;
-                wcscat(t_file, L"_");
-                wcscat(t_file, ext);
-
-                _wrename(file, t_file);
-                //ListBox_AddString(list, L"备份文件完成。");
-            }
-
-            FILE *out = _wfopen(file, L"wb");
-            if(!out)
-            {
-                ListBox_AddString(list, L"保存文件失败。");
-                ListBox_AddString(list, L"");
-                free(FileBuf);
-                return;
-            }
-
-            //PNG文件头
-            fwrite(png_sig,1,sizeof(png_sig),out);
-
-            //PNG IHDR
-            fwrite(ihdr-4,1,ihdr_len+12,out);
-
-            //PNG PLTE
-            if(plte)
-            {
-                fwrite(plte-4,1,plte_len+12,out);
-            }
-
-            //PNG IDAT
-            DWORD zopfli_size_ = __builtin_bswap32(zopfli_size);
-            fwrite((void*)&zopfli_size_,1,4,out);
-            fwrite((void*)"IDAT",1,4,out);
-            fwrite(zopfli_buf,1,zopfli_size,out);
-
-            //IDAT CRC32
-            DWORD crc32 = __builtin_bswap32(CRC32_MEM(zopfli_buf,zopfli_size));
-            fwrite((void*)&crc32,1,4,out);
-
-            //PNG尾部
-            BYTE png_end[] = {0x00,0x00,0x00,0x00,0x49,0x45,0x4e,0x44,0xae,0x42,0x60,0x82};
-            fwrite(png_end,1,sizeof(png_end),out);
-            DWORD new_len = ftell(out);
-            fclose(out);
-
-            free(zopfli_buf);
-
-            wchar_t temp[1024];
-            swprintf(temp, L"压缩文件完毕。    文件：%d 字节 -> %d 字节    压缩率：%.2f%%", FileLength, new_len, 100.0*new_len/FileLength);
-            ListBox_AddString(list, temp);
+        BYTE bits = ihdr[12];
+        BYTE channels = 1;
+        switch(ihdr[13])
+        {
+            case 2: channels = 3; break;
+            case 4: channels = 2; break;
+            case 6: channels = 4; break;
+        }
+        bits *= channels;
+        local.rowstride = ((size_t)w*bits+7)/8 + 1;
+        local.pixelsize = bits>=8 ? bits/8 : 1;
+    }
 
-            ListBox_AddString(list, L"");
-            free(FileBuf);
-            return;
+    if(min_gain>0 && LowGain(job, &local))
+    {
+        free(job->raw);
+        job->raw = 0;
+        job->low_gain = true;
+        return true;
+    }
+
+    //临时文件和原文件放在同一个目录，名字是原文件名加上序号，不受GetTempFileName的路径长度限制
+    FILE *out = 0;
+    wchar_t *name = (wchar_t *)malloc((wcslen(job->file)+32)*sizeof(wchar_t));
+    for(unsigned i=0;i<100 && !job->t_file;i++)
+    {
+        swprintf(name, L"%ls.%u.tmp", job->file, (unsigned)GetCurrentThreadId()*100+i);
+        job->t_file = MakePath(name, 0);
+        HANDLE fh = CreateFileW(job->t_file, GENERIC_WRITE, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+        if(fh==INVALID_HANDLE_VALUE)
+        {
+            free(job->t_file);
+            job->t_file = 0;
+            if(GetLastError()!=ERROR_FILE_EXISTS) break;
         }
         else
         {
-            free(idat);
-            free(out_buf);
-            ListBox_AddString(list, L"异常的PNG文件。");
-            ListBox_AddString(list, L"");
-            free(FileBuf);
-            return;
+            CloseHandle(fh);
         }
+    }
+    free(name);
+    if(job->t_file)
+    {
+        out = _wfopen(job->t_file, L"wb");
+    }
+    if(!out)
+    {
+        free(job->raw);
+        job->raw = 0;
+        job->error = L"保存文件失败。";
+        return false;
+    }
+
+    //PNG文件头
+    BYTE png_sig[] = {0x89,0x50,0x4e,0x47,0x0d,0x0a,0x1a,0x0a};
+    fwrite(png_sig,1,sizeof(png_sig),out);
 
+    //PNG IHDR
+    fwrite(job->ihdr-4,1,job->ihdr_len+12,out);
 
+    //PNG PLTE
+    if(job->plte)
+    {
+        fwrite(job->plte-4,1,job->plte_len+12,out);
     }
-    else
+
+    //PNG IDAT
+    IDATWriter w;
+    memset(&w, 0, sizeof(w));
+    w.out = out;
+    w.buf = (BYTE *)malloc(idat_chunk_size);
+    w.crc = mz_crc32(MZ_CRC32_INIT, (const BYTE*)"IDAT", 4);
+    w.total = 8 + job->ihdr_len+12 + (job->plte ? job->plte_len+12 : 0);
+    w.limit = job->FileLength;
+    w.failed = !w.buf;
+    w.stats = &job->stats;
+    local.output = IDATOutput;
+    local.outputcontext = &w;
+
+    unsigned char *zopfli_buf = 0;
+    size_t zopfli_size = 0;
+    int error = ZlibCompress(&local, job->raw, job->raw_len, &zopfli_buf, &zopfli_size);
+    free(zopfli_buf);
+    free(job->raw);
+    job->raw = 0;
+    FlushIDAT(&w);
+    free(w.buf);
+
+    //超过原文件大小而放弃的压缩不算出错，结果就是没有变小，阶段按放弃之前的算
+    if(error==2 && w.full && !w.failed)
+    {
+        error = 0;
+        job->stats.stage = w.stage;
+    }
+
+    //压缩完整时才加上标记，因为时间限制提前结束的文件下次还能压缩得更好
+    if(mark_output && !error && job->stats.stage==STAGE_COMPLETE)
+    {
+        BYTE marker[20] = {0,0,0,8,'m','p','N','G'};
+        DWORD sig = __builtin_bswap32(OptionsSignature());
+        DWORD len = __builtin_bswap32(w.data);
+        memcpy(marker+8, &sig, 4);
+        memcpy(marker+12, &len, 4);
+        DWORD crc = __builtin_bswap32((DWORD)mz_crc32(MZ_CRC32_INIT, marker+4, 12));
+        memcpy(marker+16, &crc, 4);
+        fwrite(marker,1,sizeof(marker),out);
+        w.total += sizeof(marker);
+    }
+
+    //PNG尾部
+    BYTE png_end[] = {0x00,0x00,0x00,0x00,0x49,0x45,0x4e,0x44,0xae,0x42,0x60,0x82};
+    fwrite(png_end,1,sizeof(png_end),out);
+    job->new_len = w.total + sizeof(png_end);
+
+    bool ok = !w.failed && fflush(out)==0 && !ferror(out);
+    if(ok && sync_output && job->new_len<job->FileLength)
     {
-        ListBox_AddString(list, L"不是有效的PNG文件。");
+        ok = _commit(_fileno(out))==0;
+    }
+    ok = fclose(out)==0 && ok;
+
+    if(error==1)
+    {
+        job->error = L"内存不足。";
+        return false;
+    }
+    if(!ok || error)
+    {
+        job->error = L"保存文件失败。";
+        return false;
+    }
+    return true;
+}
+
+//写入阶段：只有结果更小时才用压缩阶段写好的临时文件一次替换原文件（需要时同时备份），否则删除临时文件，把结果显示在列表里
+void WritePNG(HWND list, PNGJob *job, bool SaveBak)
+{
+    if(job->error)
+    {
+        ListBox_AddString(list, job->error);
         ListBox_AddString(list, L"");
-        free(FileBuf);
         return;
     }
 
-    return;
+    if(job->out_of_time)
+    {
+        ListBox_AddString(list, L"时间预算已经用完，没有压缩。");
+        ListBox_AddString(list, L"");
+        return;
+    }
+
+    wchar_t temp[1024];
+    if(job->unchanged || job->optimal || job->low_gain)
+    {
+        job->finished = GetFileStamp(job->file, &job->out_size, &job->out_mtime);
+        job->out_crc = job->crc;
+        if(job->unchanged)
+        {
+            ListBox_AddString(list, L"内容和上次处理后相同，跳过。");
+        }
+        else if(job->optimal)
+        {
+            ListBox_AddString(list, L"文件已经用相同的选项压缩过，跳过。");
+        }
+        else if(job->predicted_len>=job->FileLength)
+        {
+            ListBox_AddString(list, L"预计压缩后不会变小，跳过。");
+        }
+        else
+        {
+            swprintf(temp, L"预计压缩后只能减小 %.2f%%，跳过。    文件：%d 字节 -> 约 %d 字节", 100.0*(job->FileLength-job->predicted_len)/job->FileLength, job->FileLength, job->predicted_len);
+            ListBox_AddString(list, temp);
+        }
+        ListBox_AddString(list, L"");
+        return;
+    }
+
+    //压缩时输出一旦超过原文件就放弃，new_len此时也不会更小
+    DWORD new_len = job->new_len;
+    if(new_len>=job->FileLength)
+    {
+        job->finished = GetFileStamp(job->file, &job->out_size, &job->out_mtime);
+        job->out_crc = job->crc;
+        swprintf(temp, L"压缩后没有变小，保留原文件。    文件：%d 字节 -> %d 字节    迭代：%d 次", job->FileLength, new_len, job->stats.iterations);
+        ListBox_AddString(list, temp);
+        ListBox_AddString(list, L"");
+        return;
+    }
+
+    const wchar_t *file = job->file;
+    const wchar_t *t_file = job->t_file;
+
+    //原文件在替换前一直保持原样；备份只是把原文件改名，和替换由ReplaceFile一次完成，不复制数据。已有的备份保留不动，它才是最初的文件
+    wchar_t *b_file = 0;
+    bool ok = true;
+    bool backup = false;
+    if(SaveBak)
+    {
+        b_file = GetBackupName(file);
+        ok = b_file!=0;
+        backup = ok && GetFileAttributesW(b_file)==INVALID_FILE_ATTRIBUTES;
+    }
+
+    //ReplaceFile只能改名到同一个卷上，其他卷上的备份目录只好复制
+    if(backup && !SameVolume(file, b_file))
+    {
+        ok = CopyFileW(file, b_file, TRUE)!=0;
+        backup = false;
+    }
+    DWORD error = 0;
+    if(ok)
+    {
+        ok = ReplaceFileW(file, t_file, backup ? b_file : 0, REPLACEFILE_IGNORE_MERGE_ERRORS, 0, 0)!=0;
+        error = ok ? 0 : GetLastError();
+    }
+
+    //ReplaceFile在改名途中失败时，原文件可能已经改成了备份的名字，或者没有备份时改成了别的名字。
+    //有备份时把它改回去；否则把压缩后的文件放到原处，这也不行时保留临时文件，不能删掉
+    if((error==ERROR_UNABLE_TO_MOVE_REPLACEMENT || error==ERROR_UNABLE_TO_MOVE_REPLACEMENT_2) &&
+       GetFileAttributesW(file)==INVALID_FILE_ATTRIBUTES &&
+       !(backup && MoveFileW(b_file, file)))
+    {
+        ok = MoveFileW(t_file, file)!=0;
+        if(!ok)
+        {
+            free(b_file);
+            ListBox_AddString(list, L"保存文件失败，原文件已经不在原处，压缩后的文件保留在：");
+            ListBox_AddString(list, t_file);
+            ListBox_AddString(list, L"");
+            free(job->t_file);
+            job->t_file = 0;
+            return;
+        }
+    }
+    free(b_file);
+    if(!ok)
+    {
+        ListBox_AddString(list, L"保存文件失败。");
+        ListBox_AddString(list, L"");
+        return;
+    }
+    free(job->t_file);
+    job->t_file = 0;
+
+    //替换后的文件刚写过，还在缓存里，重新算一遍CRC32
+    job->finished = GetFileStamp(file, &job->out_size, &job->out_mtime);
+    if(job->want_crc)
+    {
+        DWORD size = 0;
+        const BYTE *view = MapFileReadOnly(file, &size);
+        job->finished = job->finished && view;
+        if(view)
+        {
+            job->out_crc = (DWORD)mz_crc32(MZ_CRC32_INIT, view, size);
+            UnmapViewOfFile(view);
+        }
+    }
+
+    swprintf(temp, L"压缩文件完毕。    文件：%d 字节 -> %d 字节    压缩率：%.2f%%    迭代：%d 次", job->FileLength, new_len, 100.0*new_len/job->FileLength, job->stats.iterations);
+    ListBox_AddString(list, temp);
+
+    ListBox_AddString(list, L"");
 }
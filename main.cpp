@@ -6,6 +6,7 @@
 #include <commctrl.h>
 #include <tchar.h>
 #include <stdio.h>
+#include <wctype.h>
 #include <shlobj.h>
 #include <process.h>
 #include "resource.h"
@@ -29,77 +30,1210 @@ HWND list_box = 0;
 HWND check_box = 0;
 HWND Progressbar = 0;
 
-bool isEndWith(const wchar_t *path,const wchar_t* ext)
+//扫描目录时要压缩的文件，用;分隔多个通配符
+const wchar_t *include_glob = L"*.png";
+
+//不为0时，文件名、目录名或者完整路径和它匹配的都跳过，例如*.9.png;*\cache\*
+const wchar_t *exclude_glob = 0;
+
+//是否进入符号链接和目录联接。默认跳过；跟随时记录扫描过的目录，避免链接指回上级目录时无限循环
+bool follow_links = false;
+
+//扫描目录的线程数
+int scan_threads = 4;
+
+//通配符匹配，不分大小写。*匹配任意个字符，?匹配一个字符，pattern到;或者结尾为止
+bool MatchGlob(const wchar_t *pattern, const wchar_t *text)
+{
+    const wchar_t *star = 0;
+    const wchar_t *retry = 0;
+    while(*text)
+    {
+        if(*pattern=='*')
+        {
+            star = ++pattern;
+            retry = text;
+        }
+        else if(*pattern && *pattern!=';' && (*pattern=='?' || towlower(*pattern)==towlower(*text)))
+        {
+            pattern++;
+            text++;
+        }
+        else if(star)
+        {
+            pattern = star;
+            text = ++retry;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while(*pattern=='*') pattern++;
+    return *pattern==0 || *pattern==';';
+}
+
+//patterns里任意一个通配符匹配就返回true
+bool MatchGlobList(const wchar_t *patterns, const wchar_t *text)
+{
+    while(patterns)
+    {
+        if(MatchGlob(patterns, text)) return true;
+        patterns = wcschr(patterns, ';');
+        if(patterns) patterns++;
+    }
+    return false;
+}
+
+//得到完整路径，需要时加上\\?\前缀，返回的字符串用free释放
+wchar_t *FullPath(const wchar_t *path)
+{
+    DWORD len = GetFullPathNameW(path, 0, 0, 0);
+    if(!len)
+    {
+        return MakePath(path, 0);
+    }
+    wchar_t *full = (wchar_t*)malloc(len*sizeof(wchar_t));
+    GetFullPathNameW(path, len, full, 0);
+    wchar_t *result = MakePath(full, 0);
+    free(full);
+    return result;
+}
+
+//清单：每个拖入的目录一个文件，记录上次处理后各个文件的大小、修改时间、内容的CRC32和压缩选项。
+//再次处理这个目录时，大小、修改时间和选项都和记录相同的文件不打开，直接跳过
+bool use_manifest = false;
+const wchar_t *manifest_name = L"MinifyPNG.manifest";
+
+struct ManifestEntry
+{
+    wchar_t *path;      //相对于目录的路径，0表示散列表的空位
+    unsigned long long size;
+    unsigned long long mtime;
+    DWORD crc;          //文件内容的CRC32
+    DWORD options;      //压缩选项的CRC32
+    bool seen;          //这次扫描时文件还在
+    bool updated;       //这次处理过，记录的是处理后的文件
+};
+
+struct Manifest
+{
+    wchar_t *root;
+    wchar_t *file;
+    ManifestEntry *entries;   //开放寻址的散列表，最多用一半
+    int entries_num;
+    int entries_max;
+    CRITICAL_SECTION lock;    //扫描线程和写入阶段同时访问
+    LONG skipped;
+};
+
+Manifest **manifests = 0;
+int manifests_num = 0;
+
+//这次的压缩选项，选项不同时以前的记录不算数
+DWORD manifest_options = 0;
+
+//除了压缩选项，决定文件是否跳过、是否加上标记的设置也会改变结果
+DWORD ManifestSignature()
+{
+    char sig[64];
+    sprintf(sig, " %g %d", min_gain, (int)mark_output);
+    return (DWORD)mz_crc32(OptionsSignature(), (const BYTE*)sig, strlen(sig));
+}
+
+//找到path的位置，没有时返回应该放入的空位
+ManifestEntry *FindEntry(ManifestEntry *entries, int max, const wchar_t *path)
+{
+    unsigned hash = 2166136261u;
+    for(const wchar_t *c=path; *c; c++)
+    {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    for(int i=hash&(max-1);;i=(i+1)&(max-1))
+    {
+        if(!entries[i].path || wcscmp(entries[i].path, path)==0)
+        {
+            return &entries[i];
+        }
+    }
+}
+
+//path的记录，没有时返回0
+ManifestEntry *LookupEntry(Manifest *m, const wchar_t *path)
+{
+    if(!m->entries)
+    {
+        return 0;
+    }
+    ManifestEntry *e = FindEntry(m->entries, m->entries_max, path);
+    return e->path ? e : 0;
+}
+
+//加入或者找到path的记录，path由清单释放
+ManifestEntry *AddEntry(Manifest *m, wchar_t *path)
+{
+    if(m->entries_num*2>=m->entries_max)
+    {
+        ManifestEntry *old = m->entries;
+        int old_max = m->entries_max;
+        m->entries_max = old_max ? old_max*2 : 1024;
+        m->entries = (ManifestEntry*)calloc(m->entries_max, sizeof(ManifestEntry));
+        for(int i=0;i<old_max;i++)
+        {
+            if(old[i].path) *FindEntry(m->entries, m->entries_max, old[i].path) = old[i];
+        }
+        free(old);
+    }
+    ManifestEntry *e = FindEntry(m->entries, m->entries_max, path);
+    if(e->path)
+    {
+        free(path);
+    }
+    else
+    {
+        memset(e, 0, sizeof(*e));
+        e->path = path;
+        m->entries_num++;
+    }
+    return e;
+}
+
+void FreeManifest(Manifest *m)
+{
+    for(int i=0;i<m->entries_max;i++)
+    {
+        free(m->entries[i].path);
+    }
+    free(m->entries);
+    free(m->root);
+    free(m->file);
+    DeleteCriticalSection(&m->lock);
+    free(m);
+}
+
+Manifest *NewManifest(const wchar_t *root)
+{
+    Manifest *m = (Manifest*)calloc(1, sizeof(Manifest));
+    m->root = MakePath(root, 0);
+    m->file = MakePath(root, manifest_name);
+    InitializeCriticalSection(&m->lock);
+    return m;
+}
+
+//读入清单文件，没有或者格式不对时得到空的清单。每行一个文件：大小 修改时间 CRC32 选项 UTF-8的相对路径
+void LoadManifest(Manifest *m)
+{
+    FILE *in = _wfopen(m->file, L"rb");
+    if(!in)
+    {
+        return;
+    }
+    fseek(in, 0, SEEK_END);
+    long len = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    char *buf = (char*)malloc(len+1);
+    len = (long)fread(buf, 1, len, in);
+    buf[len] = 0;
+    fclose(in);
+
+    const char header[] = "MinifyPNG manifest 1\n";
+    char *line = buf;
+    if(strncmp(line, header, sizeof(header)-1)==0)
+    {
+        line += sizeof(header)-1;
+        while(*line)
+        {
+            char *end = strchr(line, '\n');
+            if(!end) break; //最后一行不完整
+            *end = 0;
+
+            unsigned long long size = strtoull(line, &line, 10);
+            unsigned long long mtime = strtoull(line, &line, 10);
+            DWORD crc = strtoul(line, &line, 16);
+            DWORD opts = strtoul(line, &line, 16);
+            if(*line==' ' && line[1])
+            {
+                line++;
+                int wlen = MultiByteToWideChar(CP_UTF8, 0, line, -1, 0, 0);
+                wchar_t *path = (wchar_t*)malloc(wlen*sizeof(wchar_t));
+                MultiByteToWideChar(CP_UTF8, 0, line, -1, path, wlen);
+                ManifestEntry *e = AddEntry(m, path);
+                e->size = size;
+                e->mtime = mtime;
+                e->crc = crc;
+                e->options = opts;
+            }
+            line = end + 1;
+        }
+    }
+    free(buf);
+}
+
+void WriteEntry(FILE *out, const ManifestEntry *e)
+{
+    int len = WideCharToMultiByte(CP_UTF8, 0, e->path, -1, 0, 0, 0, 0);
+    char *path = (char*)malloc(len);
+    WideCharToMultiByte(CP_UTF8, 0, e->path, -1, path, len, 0, 0);
+    fprintf(out, "%llu %llu %08lx %08lx %s\n", e->size, e->mtime, (unsigned long)e->crc, (unsigned long)e->options, path);
+    free(path);
+}
+
+//写回清单文件。同一个目录可能同时有几个MinifyPNG在处理，所以先用锁文件互斥，
+//重新读入磁盘上的清单合并进来，写到临时文件后再一次替换，中途失败也不会留下不完整的清单
+bool SaveManifest(Manifest *m)
+{
+    size_t len = wcslen(m->file);
+    wchar_t *name = (wchar_t*)malloc((len+32)*sizeof(wchar_t));
+
+    //锁文件在关闭或者进程退出时自动删除，最多等一分钟
+    swprintf(name, L"%ls.lock", m->file);
+    HANDLE lock = INVALID_HANDLE_VALUE;
+    for(int i=0;i<600 && lock==INVALID_HANDLE_VALUE;i++)
+    {
+        lock = CreateFileW(name, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_FLAG_DELETE_ON_CLOSE, 0);
+        if(lock==INVALID_HANDLE_VALUE) Sleep(100);
+    }
+    if(lock==INVALID_HANDLE_VALUE)
+    {
+        free(name);
+        return false;
+    }
+
+    Manifest *disk = NewManifest(m->root);
+    LoadManifest(disk);
+
+    swprintf(name, L"%ls.%u.tmp", m->file, (unsigned)GetCurrentThreadId());
+    FILE *out = _wfopen(name, L"wb");
+    bool ok = out!=0;
+    if(ok)
+    {
+        fputs("MinifyPNG manifest 1\n", out);
+
+        //这次处理过的用这次的记录；这次见到但没有处理的用磁盘上的，它可能刚被别的进程更新；开始时有、这次没见到的文件已经不在了
+        for(int i=0;i<m->entries_max;i++)
+        {
+            ManifestEntry *e = &m->entries[i];
+            if(!e->path) continue;
+            ManifestEntry *d = LookupEntry(disk, e->path);
+            if(e->updated)
+            {
+                WriteEntry(out, e);
+            }
+            else if(e->seen)
+            {
+                WriteEntry(out, d ? d : e);
+            }
+            if(d) d->seen = true;
+        }
+
+        //别的进程这期间加入的文件
+        for(int i=0;i<disk->entries_max;i++)
+        {
+            ManifestEntry *d = &disk->entries[i];
+            if(d->path && !d->seen) WriteEntry(out, d);
+        }
+
+        ok = fflush(out)==0 && !ferror(out);
+        ok = fclose(out)==0 && ok;
+        ok = ok && MoveFileExW(name, m->file, MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH);
+        if(!ok) DeleteFileW(name);
+    }
+
+    FreeManifest(disk);
+    CloseHandle(lock);
+    free(name);
+    return ok;
+}
+
+//path相对于清单目录的部分
+const wchar_t *RelativePath(Manifest *m, const wchar_t *path)
+{
+    //和IsBackupDir一样去掉开头的\，两边的UNC路径前缀不同时也能对齐
+    const wchar_t *root = PlainPath(m->root);
+    const wchar_t *rel = PlainPath(path);
+    while(*root=='\\') root++;
+    while(*rel=='\\') rel++;
+    rel += wcslen(root);
+    while(*rel=='\\') rel++;
+    return rel;
+}
+
+//扫描时查找文件的记录。大小、修改时间和选项都相同时返回true，跳过这个文件；
+//只有修改时间不同时给出记录的CRC32，读取后内容相同也不再压缩
+bool CheckManifest(Manifest *m, const wchar_t *path, unsigned long long size, unsigned long long mtime, DWORD *known_crc, bool *has_known_crc)
+{
+    *has_known_crc = false;
+    const wchar_t *rel = RelativePath(m, path);
+    EnterCriticalSection(&m->lock);
+    ManifestEntry *e = LookupEntry(m, rel);
+    bool skip = false;
+    if(e)
+    {
+        e->seen = true;
+        if(e->size==size && e->options==manifest_options)
+        {
+            skip = e->mtime==mtime;
+            *known_crc = e->crc;
+            *has_known_crc = !skip;
+        }
+    }
+    LeaveCriticalSection(&m->lock);
+    if(skip)
+    {
+        InterlockedIncrement(&m->skipped);
+    }
+    return skip;
+}
+
+//记下处理完的文件
+void UpdateManifest(Manifest *m, const PNGJob *job)
 {
-	if(!path || !ext) return false;
-    int len1 = wcslen(path);
-    int len2 = wcslen(ext);
-    if(len2>len1) return false;
-    return !_memicmp(path + len1 - len2,ext,len2*sizeof(wchar_t));
+    const wchar_t *rel = RelativePath(m, job->file);
+    wchar_t *path = (wchar_t*)malloc((wcslen(rel)+1)*sizeof(wchar_t));
+    wcscpy(path, rel);
+    EnterCriticalSection(&m->lock);
+    ManifestEntry *e = AddEntry(m, path);
+    e->size = job->out_size;
+    e->mtime = job->out_mtime;
+    e->crc = job->out_crc;
+    e->options = manifest_options;
+    e->seen = true;
+    e->updated = true;
+    LeaveCriticalSection(&m->lock);
 }
 
+//找到的文件。扫描线程和流水线同时访问，用files_lock保护；文件名单独分配，加入后一直有效
 struct files_
 {
-    wchar_t file_name[MAX_PATH];
+    wchar_t *file_name;
+
+    //文件所在目录的清单，不用清单时为0；记录的CRC32见PNGJob
+    Manifest *manifest;
+    DWORD known_crc;
+    bool has_known_crc;
+
+    //有时间预算时的估计：压缩后预计减小的字节数，和以快速压缩的秒数计的压缩开销。order是找到的顺序
+    double saving;
+    double cost;
+    int order;
 };
 
 files_ *files = 0;
 int files_num = 0;
+int files_max = 0;
+CRITICAL_SECTION files_lock;
+
+//信号量：每找到一个文件释放一次，扫描结束时再释放一次
+HANDLE files_found = 0;
+
 void ResetFiles()
 {
-    if(files)
+    for(int i=0;i<files_num;i++)
     {
-        free(files);
-        files = 0;
+        free(files[i].file_name);
     }
+    free(files);
+    files = 0;
     files_num = 0;
+    files_max = 0;
 }
-void AppendFiles(const wchar_t *file)
+
+//加入找到的文件，file之后由ResetFiles释放
+void AppendFiles(wchar_t *file, Manifest *manifest, DWORD known_crc, bool has_known_crc)
 {
+    EnterCriticalSection(&files_lock);
+    if(files_num==files_max)
+    {
+        files_max = files_max ? files_max*2 : 256;
+        files = (files_*)realloc(files, sizeof(files_)*files_max);
+    }
+    files[files_num].file_name = file;
+    files[files_num].manifest = manifest;
+    files[files_num].known_crc = known_crc;
+    files[files_num].has_known_crc = has_known_crc;
+    files[files_num].saving = 0;
+    files[files_num].cost = 0;
     files_num++;
-    files = (files_*)realloc(files, sizeof(files_)*files_num );
-    memcpy(files[files_num-1].file_name,file,sizeof(files_));
+    LeaveCriticalSection(&files_lock);
+    ReleaseSemaphore(files_found, 1, 0);
 }
 
-void FindFileInDir(const wchar_t *szFilename,int dept)
+//复制第i个文件，还没有找到时返回false
+bool GetFile(int i, files_ *file)
 {
-    if(dept==4) return;
+    EnterCriticalSection(&files_lock);
+    bool found = i<files_num;
+    if(found) *file = files[i];
+    LeaveCriticalSection(&files_lock);
+    return found;
+}
 
-    wchar_t temp[MAX_PATH];
-    _tcscpy(temp, szFilename);
-    _tcscat(temp, _T("\\*.*"));
+int GetFilesNum()
+{
+    EnterCriticalSection(&files_lock);
+    int num = files_num;
+    LeaveCriticalSection(&files_lock);
+    return num;
+}
 
-    WIN32_FIND_DATA ffbuf;
-    HANDLE hfind = FindFirstFile(temp, &ffbuf);
-    if (hfind != INVALID_HANDLE_VALUE)
+//目录的标识：卷序列号和文件索引，同一个目录经过不同的链接得到的也相同
+struct DirId
+{
+    DWORD volume;
+    DWORD high;
+    DWORD low;
+    bool used;
+};
+
+//目录扫描：几个线程从共享的栈里取目录，找到的文件直接交给流水线，子目录放回栈里，没有深度限制
+struct ScanItem
+{
+    wchar_t *dir;
+    Manifest *manifest;
+};
+
+struct Scanner
+{
+    ScanItem *dirs;
+    int dirs_num;
+    int dirs_max;
+    LONG pending;       //栈里和正在扫描的目录数，减到0时扫描结束
+    CRITICAL_SECTION lock;
+    HANDLE dirready;    //信号量：栈里的目录数，扫描结束时再给每个线程释放一次
+    HANDLE *threads;
+    int threads_num;
+
+    //跟随链接时扫描过的目录，开放寻址的散列表，最多用一半
+    DirId *visited;
+    int visited_num;
+    int visited_max;
+};
+
+Scanner scanner;
+
+//放入散列表，已经有了时返回false
+bool InsertDirId(DirId *table, int max, const DirId *id)
+{
+    unsigned hash = id->low*2654435761u ^ id->high ^ id->volume;
+    for(int i=hash&(max-1);;i=(i+1)&(max-1))
     {
-        do
+        if(!table[i].used)
         {
-            if( isEndWith(ffbuf.cFileName, _T(".png")))
-            {
-                _tcscpy(temp, szFilename);
-                _tcscat(temp, _T("\\"));
-                _tcscat(temp, ffbuf.cFileName);
+            table[i] = *id;
+            table[i].used = true;
+            return true;
+        }
+        if(table[i].volume==id->volume && table[i].high==id->high && table[i].low==id->low)
+        {
+            return false;
+        }
+    }
+}
 
-                //MinifyPNG(list_box, temp);
-                AppendFiles(temp);
+//记下目录dir，已经扫描过时返回false。取不到标识时返回true，打不开的目录由FindFirstFile跳过
+bool VisitDir(const wchar_t *dir)
+{
+    HANDLE fh = CreateFileW(dir, 0, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE, 0, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, 0);
+    if(fh==INVALID_HANDLE_VALUE)
+    {
+        return true;
+    }
+    BY_HANDLE_FILE_INFORMATION info;
+    BOOL ok = GetFileInformationByHandle(fh, &info);
+    CloseHandle(fh);
+    if(!ok)
+    {
+        return true;
+    }
+    DirId id = {info.dwVolumeSerialNumber, info.nFileIndexHigh, info.nFileIndexLow, true};
+
+    Scanner *s = &scanner;
+    EnterCriticalSection(&s->lock);
+    if(s->visited_num*2>=s->visited_max)
+    {
+        DirId *old = s->visited;
+        int old_max = s->visited_max;
+        s->visited_max = old_max ? old_max*2 : 1024;
+        s->visited = (DirId*)calloc(s->visited_max, sizeof(DirId));
+        for(int i=0;i<old_max;i++)
+        {
+            if(old[i].used) InsertDirId(s->visited, s->visited_max, &old[i]);
+        }
+        free(old);
+    }
+    bool fresh = InsertDirId(s->visited, s->visited_max, &id);
+    if(fresh) s->visited_num++;
+    LeaveCriticalSection(&s->lock);
+    return fresh;
+}
+
+//备份目录在拖入的目录里面时，不压缩里面的备份
+bool IsBackupDir(const wchar_t *dir)
+{
+    if(!backup_dir) return false;
+    const wchar_t *a = PlainPath(dir);
+    const wchar_t *b = PlainPath(backup_dir);
+    while(*a=='\\') a++;
+    while(*b=='\\') b++;
+    return _wcsicmp(a, b)==0;
+}
+
+//把目录dir放入栈里，dir之后由扫描线程释放。manifest是它所在的拖入目录的清单
+void PushDir(wchar_t *dir, Manifest *manifest)
+{
+    Scanner *s = &scanner;
+    InterlockedIncrement(&s->pending);
+    EnterCriticalSection(&s->lock);
+    if(s->dirs_num==s->dirs_max)
+    {
+        s->dirs_max = s->dirs_max ? s->dirs_max*2 : 64;
+        s->dirs = (ScanItem*)realloc(s->dirs, sizeof(ScanItem)*s->dirs_max);
+    }
+    s->dirs[s->dirs_num].dir = dir;
+    s->dirs[s->dirs_num].manifest = manifest;
+    s->dirs_num++;
+    LeaveCriticalSection(&s->lock);
+    ReleaseSemaphore(s->dirready, 1, 0);
+}
+
+//一个目录扫描完。全部扫描完时让扫描线程退出，并通知流水线不会再有新文件
+void DirDone()
+{
+    Scanner *s = &scanner;
+    if(InterlockedDecrement(&s->pending)==0)
+    {
+        ReleaseSemaphore(s->dirready, s->threads_num, 0);
+        ReleaseSemaphore(files_found, 1, 0);
+    }
+}
+
+#ifndef FIND_FIRST_EX_LARGE_FETCH
+#define FIND_FIRST_EX_LARGE_FETCH 2
+#endif
+#ifndef IO_REPARSE_TAG_MOUNT_POINT
+#define IO_REPARSE_TAG_MOUNT_POINT 0xA0000003L
+#endif
+#ifndef IO_REPARSE_TAG_SYMLINK
+#define IO_REPARSE_TAG_SYMLINK 0xA000000CL
+#endif
+
+//目录项是指向别处的目录（符号链接或目录联接）。云盘、去重等其它重解析点的文件和目录照常处理
+bool IsLinkDir(const WIN32_FIND_DATAW *ffbuf)
+{
+    if(!(ffbuf->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) return false;
+    if(!(ffbuf->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) return false;
+    return ffbuf->dwReserved0==IO_REPARSE_TAG_SYMLINK || ffbuf->dwReserved0==IO_REPARSE_TAG_MOUNT_POINT;
+}
+
+void ScanDir(const wchar_t *dir, Manifest *manifest)
+{
+    //不需要短文件名，一次取回更多的目录项
+    wchar_t *pattern = MakePath(dir, L"*");
+    WIN32_FIND_DATAW ffbuf;
+    HANDLE hfind = FindFirstFileExW(pattern, (FINDEX_INFO_LEVELS)FindExInfoBasic, &ffbuf, FindExSearchNameMatch, 0, FIND_FIRST_EX_LARGE_FETCH);
+    free(pattern);
+    if(hfind==INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    do
+    {
+        const wchar_t *name = ffbuf.cFileName;
+        if(wcscmp(name,L".")==0 || wcscmp(name,L"..")==0) continue;
+        if(!follow_links && IsLinkDir(&ffbuf)) continue;
+        if(exclude_glob && MatchGlobList(exclude_glob, name)) continue;
+
+        bool is_dir = (ffbuf.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)!=0;
+        if(!is_dir && !MatchGlobList(include_glob, name)) continue;
+
+        wchar_t *path = MakePath(dir, name);
+        if( (exclude_glob && MatchGlobList(exclude_glob, PlainPath(path))) ||
+            (is_dir && (IsBackupDir(path) || (follow_links && !VisitDir(path)))) )
+        {
+            free(path);
+        }
+        else if(is_dir)
+        {
+            PushDir(path, manifest);
+        }
+        else if(!manifest)
+        {
+            AppendFiles(path, 0, 0, false);
+        }
+        else
+        {
+            //用目录项里的大小和修改时间查清单，跳过的文件不用打开
+            unsigned long long size = ((unsigned long long)ffbuf.nFileSizeHigh<<32) | ffbuf.nFileSizeLow;
+            DWORD known_crc = 0;
+            bool has_known_crc = false;
+            if(CheckManifest(manifest, path, size, FileTimeValue(&ffbuf.ftLastWriteTime), &known_crc, &has_known_crc))
+            {
+                free(path);
             }
             else
             {
-                if( (ffbuf.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && wcscmp(ffbuf.cFileName,L".") && wcscmp(ffbuf.cFileName,L"..") )
-                {
-                    //
-                    _tcscpy(temp, szFilename);
-                    _tcscat(temp, _T("\\"));
-                    _tcscat(temp, ffbuf.cFileName);
-                    FindFileInDir(temp, dept+1);
-                }
+                AppendFiles(path, manifest, known_crc, has_known_crc);
+            }
+        }
+    }
+    while(FindNextFileW(hfind, &ffbuf));
+    FindClose(hfind);
+}
+
+unsigned __stdcall ScanThread(void *context)
+{
+    Scanner *s = (Scanner*)context;
+    for(;;)
+    {
+        WaitForSingleObject(s->dirready, INFINITE);
+        EnterCriticalSection(&s->lock);
+        ScanItem item = {0, 0};
+        if(s->dirs_num>0) item = s->dirs[--s->dirs_num];
+        LeaveCriticalSection(&s->lock);
+        if(!item.dir)
+        {
+            return 0;
+        }
+        ScanDir(item.dir, item.manifest);
+        free(item.dir);
+        DirDone();
+    }
+}
+
+//开始扫描拖入的文件和目录。拖入的文件直接加入列表，目录交给扫描线程，不等扫描完就返回
+void StartScan(HDROP hDrop)
+{
+    Scanner *s = &scanner;
+    memset(s, 0, sizeof(*s));
+    InitializeCriticalSection(&s->lock);
+    s->dirready = CreateSemaphore(0, 0, LONG_MAX, 0);
+    s->threads_num = scan_threads;
+
+    //StartScan自己也算一个，放入目录的过程中不会被当成扫描结束
+    s->pending = 1;
+    manifest_options = ManifestSignature();
+
+    int nNumFiles = DragQueryFile(hDrop, -1, NULL, 0);
+    for(int i=0;i<nNumFiles;i++)
+    {
+        UINT len = DragQueryFile(hDrop, i, NULL, 0);
+        wchar_t *szFilename = (wchar_t*)malloc((len+1)*sizeof(wchar_t));
+        DragQueryFile(hDrop, i, szFilename, len+1);
+        wchar_t *path = FullPath(szFilename);
+        free(szFilename);
+
+        DWORD attr = GetFileAttributesW(path);
+        if(attr!=INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY))
+        {
+            if(follow_links) VisitDir(path);
+
+            //每个拖入的目录一个清单
+            Manifest *manifest = 0;
+            if(use_manifest)
+            {
+                manifest = NewManifest(path);
+                LoadManifest(manifest);
+                manifests = (Manifest**)realloc(manifests, sizeof(Manifest*)*(manifests_num+1));
+                manifests[manifests_num++] = manifest;
+            }
+            PushDir(path, manifest);
+        }
+        else
+        {
+            AppendFiles(path, 0, 0, false);
+        }
+    }
+
+    s->threads = (HANDLE*)malloc(sizeof(HANDLE) * s->threads_num);
+    for(int i=0;i<s->threads_num;i++)
+    {
+        s->threads[i] = (HANDLE)_beginthreadex(0, 0, ScanThread, s, 0, 0);
+    }
+    DirDone();
+}
+
+//等扫描线程退出，释放扫描用到的资源。可以调用多次
+void FinishScan()
+{
+    Scanner *s = &scanner;
+    if(!s->threads)
+    {
+        return;
+    }
+    WaitForMultipleObjects(s->threads_num, s->threads, TRUE, INFINITE);
+    for(int i=0;i<s->threads_num;i++)
+    {
+        CloseHandle(s->threads[i]);
+    }
+    free(s->threads);
+    s->threads = 0;
+    free(s->dirs);
+    free(s->visited);
+    CloseHandle(s->dirready);
+    DeleteCriticalSection(&s->lock);
+}
+
+//写回并释放所有清单，在列表里显示跳过的文件数
+void SaveManifests()
+{
+    LONG skipped = 0;
+    for(int i=0;i<manifests_num;i++)
+    {
+        skipped += manifests[i]->skipped;
+        if(!SaveManifest(manifests[i]))
+        {
+            ListBox_AddString(list_box, manifests[i]->file);
+            ListBox_AddString(list_box, L"保存清单失败。");
+            ListBox_AddString(list_box, L"");
+        }
+        FreeManifest(manifests[i]);
+    }
+    free(manifests);
+    manifests = 0;
+    manifests_num = 0;
+
+    if(skipped>0)
+    {
+        wchar_t temp[1024];
+        swprintf(temp, L"清单中记录的 %d 个文件没有变化，已跳过。", (int)skipped);
+        ListBox_AddString(list_box, temp);
+        ListBox_AddString(list_box, L"");
+    }
+}
+
+//流水线中的一个文件，压缩完成时发出事件
+struct PipelineJob
+{
+    PNGJob job;
+    Manifest *manifest;
+    HANDLE done;
+    double readtime;
+    double compresstime;
+};
+
+//流水线的统计：各阶段忙碌的秒数和队列深度
+struct PipelineStats
+{
+    double readtime;
+    double compresstime;
+    double writetime;
+    LONG readqueue;     //已读取、等待压缩的文件数
+    LONG writequeue;    //已压缩、等待写入的文件数
+    LONG maxreadqueue;
+    LONG maxwritequeue;
+};
+
+//读取线程预读后面的文件，几个压缩线程同时压缩，写入按文件顺序在DoDropFiles的线程里进行
+//文件边扫描边进入流水线，总数事先不知道。同时在流水线里的文件放在环形数组里，第i个文件用jobs[i%slots_num]
+struct Pipeline
+{
+    PipelineJob *jobs;
+    int slots_num;
+    LONG jobs_num;      //已读取的文件数，读取线程退出后就是文件总数
+    LONG written;       //已写入的文件数
+    int workers;
+    HANDLE slots;       //信号量：环形数组里空闲的位置
+    HANDLE readready;   //信号量：已读取、还没有压缩线程领取的文件
+    HANDLE writeready;  //信号量：已读取、写入阶段还没有取走的文件，读取线程退出时再释放一次
+    LONG nextcompress;
+    PipelineStats stats;
+};
+
+//压缩线程数，0表示和处理器个数相同
+int compress_threads = 0;
+
+//预读的文件数，超出压缩线程数的部分
+int prefetch_files = 2;
+
+//时间预算，单位秒，0表示不限。设置后先估计每个文件，按每秒CPU时间能减小的字节数从高到低处理，到时间就停下
+double time_budget = 0;
+
+//压缩线程数。没有指定时和处理器个数相同，但不超过可用内存能容纳的个数，32位程序的地址空间也算在内。
+//每个压缩线程最多要用：匹配缓存，加上一个主块每字节约16字节的LZ77结果、路径和代价，再加上原始图像数据
+int WorkerCount()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int workers = compress_threads>0 ? compress_threads : (int)info.dwNumberOfProcessors;
+    MEMORYSTATUSEX mem;
+    mem.dwLength = sizeof(mem);
+    if(compress_threads<=0 && GlobalMemoryStatusEx(&mem))
+    {
+        unsigned long long block = options.masterblocksize>0 ? options.masterblocksize : MASTER_BLOCK_SIZE;
+        unsigned long long cache = options.cachememory>0 ? options.cachememory : (4+3*options.cachedlengths)*block;
+        unsigned long long per_worker = cache + 20*block;
+        unsigned long long avail = mem.ullAvailPhys<mem.ullAvailVirtual ? mem.ullAvailPhys : mem.ullAvailVirtual;
+        if((unsigned long long)workers > avail/per_worker) workers = (int)(avail/per_worker);
+    }
+    //压缩线程和读取线程一起等待，WaitForMultipleObjects最多等MAXIMUM_WAIT_OBJECTS个
+    if(workers>MAXIMUM_WAIT_OBJECTS-1) workers = MAXIMUM_WAIT_OBJECTS-1;
+    return workers<1 ? 1 : workers;
+}
+
+Pipeline *pipeline = 0;
+
+int ProgressCallback(double fraction, void *context)
+{
+    ((PNGJob*)context)->progress = fraction;
+    if(!pipeline)
+    {
+        return 0;
+    }
+
+    //每个文件占100格，写完的文件加上环形数组里正在处理的
+    double done = pipeline->written;
+    for(int i=0;i<pipeline->slots_num;i++)
+    {
+        done += pipeline->jobs[i].job.progress;
+    }
+    SendMessage(Progressbar, PBM_SETPOS, (int)(done*100), 0);
+    return 0;
+}
+
+void QueuePush(LONG *queue, LONG *maxqueue)
+{
+    LONG depth = InterlockedIncrement(queue);
+    LONG old = *maxqueue;
+    while(depth>old && InterlockedCompareExchange(maxqueue, depth, old)!=old)
+    {
+        old = *maxqueue;
+    }
+}
+
+unsigned __stdcall ReaderThread(void *context)
+{
+    Pipeline *p = (Pipeline*)context;
+    for(int i=0;;i++)
+    {
+        //等扫描找到下一个文件，扫描结束后GetFile返回0
+        WaitForSingleObject(files_found, INFINITE);
+        files_ file;
+        if(!GetFile(i, &file))
+        {
+            break;
+        }
+
+        //时间预算用完后不再读取新的文件
+        if(deadline>0 && GetSeconds()>=deadline)
+        {
+            break;
+        }
+        WaitForSingleObject(p->slots, INFINITE);
+
+        PipelineJob *pj = &p->jobs[i % p->slots_num];
+        InitPNGJob(&pj->job, file.file_name);
+        pj->manifest = file.manifest;
+        pj->job.want_crc = file.manifest!=0;
+        pj->job.known_crc = file.known_crc;
+        pj->job.has_known_crc = file.has_known_crc;
+        ResetEvent(pj->done);
+        double start = GetSeconds();
+        ReadPNG(&pj->job);
+        pj->readtime = GetSeconds() - start;
+
+        InterlockedExchange(&p->jobs_num, i+1);
+        QueuePush(&p->stats.readqueue, &p->stats.maxreadqueue);
+        ReleaseSemaphore(p->readready, 1, 0);
+        ReleaseSemaphore(p->writeready, 1, 0);
+    }
+
+    //唤醒所有压缩线程和写入阶段，让它们发现文件已经分完
+    ReleaseSemaphore(p->readready, p->workers, 0);
+    ReleaseSemaphore(p->writeready, 1, 0);
+    return 0;
+}
+
+unsigned __stdcall CompressThread(void *context)
+{
+    Pipeline *p = (Pipeline*)context;
+    for(;;)
+    {
+        WaitForSingleObject(p->readready, INFINITE);
+        int i = InterlockedIncrement(&p->nextcompress) - 1;
+        if(i>=p->jobs_num)
+        {
+            return 0;
+        }
+        InterlockedDecrement(&p->stats.readqueue);
+
+        PipelineJob *pj = &p->jobs[i % p->slots_num];
+        if(!pj->job.error)
+        {
+            double start = GetSeconds();
+            CompressPNG(&pj->job);
+            pj->compresstime = GetSeconds() - start;
+        }
+
+        QueuePush(&p->stats.writequeue, &p->stats.maxwritequeue);
+        SetEvent(pj->done);
+    }
+}
+
+//估计一个文件：用miniz的默认级别快速压缩图像数据。在测试图片上，zopfli的结果大多是它的0.88到0.96倍，
+//所需的时间也大致和它的时间成正比，比按图像数据的长度估计准得多；另外每个文件还有相当于0.1毫秒快速压缩的固定开销
+void EstimateFile(files_ *file)
+{
+    PNGJob job;
+    InitPNGJob(&job, file->file_name);
+    if(ReadPNG(&job) && job.raw)
+    {
+        mz_ulong len = mz_compressBound(job.raw_len);
+        BYTE *buf = (BYTE *)malloc(len);
+        double start = GetSeconds();
+        if(buf && mz_compress2(buf, &len, job.raw, job.raw_len, MZ_DEFAULT_LEVEL)==MZ_OK)
+        {
+            file->cost = GetSeconds() - start + 1e-4;
+            file->saving = (double)job.FileLength - PNGLength(&job, (size_t)(len*0.92));
+        }
+        free(buf);
+    }
+    FreePNGJob(&job);
+}
+
+LONG next_estimate = 0;
+
+//扫描已经结束，files不再变化，几个线程各取一个文件估计
+unsigned __stdcall EstimateThread(void *context)
+{
+    for(;;)
+    {
+        int i = InterlockedIncrement(&next_estimate) - 1;
+        if(i>=files_num || (deadline>0 && GetSeconds()>=deadline))
+        {
+            return 0;
+        }
+        EstimateFile(&files[i]);
+    }
+}
+
+//每秒能减小的字节数，预计不会变小的文件为0
+double Benefit(const files_ *file)
+{
+    return file->saving>0 && file->cost>0 ? file->saving/file->cost : 0;
+}
+
+int CompareBenefit(const void *a, const void *b)
+{
+    const files_ *x = (const files_*)a;
+    const files_ *y = (const files_*)b;
+    double bx = Benefit(x);
+    double by = Benefit(y);
+    if(bx!=by)
+    {
+        return bx>by ? -1 : 1;
+    }
+    return x->order - y->order;
+}
+
+//有时间预算时，等扫描完估计所有文件，按收益从高到低重新排列，收益相同的保持找到的顺序
+void PlanFiles()
+{
+    FinishScan();
+
+    wchar_t temp[1024];
+    swprintf(temp, L"正在估计 %d 个文件……", files_num);
+    ListBox_AddString(list_box, temp);
+
+    for(int i=0;i<files_num;i++)
+    {
+        files[i].order = i;
+    }
+    next_estimate = 0;
+    int workers = WorkerCount();
+    HANDLE *threads = (HANDLE*)malloc(sizeof(HANDLE) * workers);
+    for(int i=0;i<workers;i++)
+    {
+        threads[i] = (HANDLE)_beginthreadex(0, 0, EstimateThread, 0, 0, 0);
+    }
+    WaitForMultipleObjects(workers, threads, TRUE, INFINITE);
+    for(int i=0;i<workers;i++)
+    {
+        CloseHandle(threads[i]);
+    }
+    free(threads);
+
+    qsort(files, files_num, sizeof(files_), CompareBenefit);
+    double saving = 0;
+    for(int i=0;i<files_num;i++)
+    {
+        if(files[i].saving>0) saving += files[i].saving;
+    }
+    swprintf(temp, L"已经按每秒能减小的字节数排好顺序，预计一共可以减小 %.0f 字节。", saving);
+    ListBox_AddString(list_box, temp);
+    ListBox_AddString(list_box, L"");
+}
+
+//有时间预算时的结果。剩下的开销按已经压缩的文件实际用的时间和预计的开销之比换算成秒数
+struct BudgetReport
+{
+    double saved;       //实际减小的字节数
+    int cut;            //到了截止时间没有压缩完整的文件
+    int left;           //没有压缩的文件
+    double left_saving;
+    double left_cost;
+    double done_time;
+    double done_cost;
+};
+
+void AddLeftFile(BudgetReport *r, const files_ *file)
+{
+    r->left++;
+    if(file->saving>0) r->left_saving += file->saving;
+    r->left_cost += file->cost;
+}
+
+void ShowBudgetReport(const BudgetReport *r, int workers)
+{
+    wchar_t temp[1024];
+    swprintf(temp, L"时间预算：已经减小 %.0f 字节，%d 个文件因为到了截止时间没有压缩完整。", r->saved, r->cut);
+    ListBox_AddString(list_box, temp);
+    if(r->left>0 && r->done_cost>0)
+    {
+        swprintf(temp, L"还有 %d 个文件没有压缩，预计可以再减小 %.0f 字节，%d 个线程大约还需要 %.0f 秒。",
+                 r->left, r->left_saving, workers, r->left_cost*r->done_time/r->done_cost/workers);
+        ListBox_AddString(list_box, temp);
+    }
+    else if(r->left>0)
+    {
+        swprintf(temp, L"还有 %d 个文件没有压缩，预计可以再减小 %.0f 字节。", r->left, r->left_saving);
+        ListBox_AddString(list_box, temp);
+    }
+    ListBox_AddString(list_box, L"");
+}
+
+void RunPipeline(bool save_bak)
+{
+    Pipeline p;
+    memset(&p, 0, sizeof(p));
+    p.workers = WorkerCount();
+    p.slots_num = p.workers + prefetch_files;
+    p.jobs = (PipelineJob*)calloc(p.slots_num, sizeof(PipelineJob));
+    for(int i=0;i<p.slots_num;i++)
+    {
+        p.jobs[i].done = CreateEvent(0, TRUE, FALSE, 0);
+    }
+    p.slots = CreateSemaphore(0, p.slots_num, p.slots_num, 0);
+    p.readready = CreateSemaphore(0, 0, LONG_MAX, 0);
+    p.writeready = CreateSemaphore(0, 0, LONG_MAX, 0);
+    pipeline = &p;
+
+    BudgetReport budget;
+    memset(&budget, 0, sizeof(budget));
+
+    double start = GetSeconds();
+    HANDLE *threads = (HANDLE*)malloc(sizeof(HANDLE) * (p.workers + 1));
+    threads[0] = (HANDLE)_beginthreadex(0, 0, ReaderThread, &p, 0, 0);
+    for(int i=0;i<p.workers;i++)
+    {
+        threads[i+1] = (HANDLE)_beginthreadex(0, 0, CompressThread, &p, 0, 0);
+    }
+
+    //写入阶段：按顺序等待每个文件，列表里的输出因此和逐个处理时一样
+    for(int i=0;;i++)
+    {
+        WaitForSingleObject(p.writeready, INFINITE);
+        if(i>=p.jobs_num)
+        {
+            break;
+        }
+        PipelineJob *pj = &p.jobs[i % p.slots_num];
+        ListBox_AddString(list_box, pj->job.file);
+        if(!pj->job.error)
+        {
+            ListBox_AddString(list_box, L"准备重新压缩。");
+        }
+
+        WaitForSingleObject(pj->done, INFINITE);
+        InterlockedDecrement(&p.stats.writequeue);
+
+        double write_start = GetSeconds();
+        WritePNG(list_box, &pj->job, save_bak);
+
+        //因为时间限制没有压缩完整的文件不记入清单，下次还要继续压缩
+        if(pj->manifest && pj->job.finished && pj->job.stats.stage==STAGE_COMPLETE)
+        {
+            UpdateManifest(pj->manifest, &pj->job);
+        }
+        p.stats.writetime += GetSeconds() - write_start;
+        p.stats.readtime += pj->readtime;
+        p.stats.compresstime += pj->compresstime;
+
+        if(deadline>0)
+        {
+            files_ file;
+            GetFile(i, &file);
+            PNGJob *job = &pj->job;
+            if(job->out_of_time)
+            {
+                AddLeftFile(&budget, &file);
+            }
+            else if(job->new_len>0)
+            {
+                budget.done_time += pj->compresstime;
+                budget.done_cost += file.cost;
+                if(job->stats.stage!=STAGE_COMPLETE) budget.cut++;
+            }
+            if(job->finished && job->out_size<job->FileLength)
+            {
+                budget.saved += job->FileLength - job->out_size;
             }
         }
-        while (FindNextFile(hfind, &ffbuf));
-        FindClose(hfind);
+
+        FreePNGJob(&pj->job);
+        pj->job.progress = 0;
+        InterlockedIncrement(&p.written);
+
+        //扫描还没结束时文件总数还在增加
+        SendMessage(Progressbar, PBM_SETRANGE32, 0, GetFilesNum()*100);
+        SendMessage(Progressbar, PBM_SETPOS, (i+1)*100, 0);
+        ReleaseSemaphore(p.slots, 1, 0);
+    }
+
+    WaitForMultipleObjects(p.workers + 1, threads, TRUE, INFINITE);
+    double elapsed = GetSeconds() - start;
+    for(int i=0;i<p.workers+1;i++)
+    {
+        CloseHandle(threads[i]);
     }
+    free(threads);
+
+    if(p.jobs_num>0)
+    {
+        //各阶段的利用率：忙碌时间占总时间的比例，压缩阶段按线程数平均
+        if(elapsed<=0) elapsed = 1e-3;
+        wchar_t temp[1024];
+        swprintf(temp, L"读取：%.1f 秒 (%.0f%%)    压缩：%.1f 秒，%d 个线程 (%.0f%%)    写入：%.1f 秒 (%.0f%%)    总计：%.1f 秒",
+                 p.stats.readtime, 100.0*p.stats.readtime/elapsed,
+                 p.stats.compresstime, p.workers, 100.0*p.stats.compresstime/(elapsed*p.workers),
+                 p.stats.writetime, 100.0*p.stats.writetime/elapsed, elapsed);
+        ListBox_AddString(list_box, temp);
+        swprintf(temp, L"最大队列深度：等待压缩 %d 个文件，等待写入 %d 个文件", (int)p.stats.maxreadqueue, (int)p.stats.maxwritequeue);
+        ListBox_AddString(list_box, temp);
+        ListBox_AddString(list_box, L"");
+    }
+
+    //读取线程到时间停下后没有读取的文件
+    if(deadline>0)
+    {
+        for(int i=p.jobs_num;i<files_num;i++)
+        {
+            AddLeftFile(&budget, &files[i]);
+        }
+        ShowBudgetReport(&budget, p.workers);
+    }
+
+    pipeline = 0;
+    for(int i=0;i<p.slots_num;i++)
+    {
+        CloseHandle(p.jobs[i].done);
+    }
+    CloseHandle(p.slots);
+    CloseHandle(p.readready);
+    CloseHandle(p.writeready);
+    free(p.jobs);
 }
+
 void DoDropFiles(LPVOID pvoid)
 {
     static int running = false;
@@ -108,37 +1242,37 @@ void DoDropFiles(LPVOID pvoid)
     {
         running = true;
         HDROP hDrop = (HDROP)pvoid;
-        int nNumFiles = DragQueryFile(hDrop, -1, NULL, 0);
 
         ListBox_ResetContent(list_box);
         ResetFiles();
+        files_found = CreateSemaphore(0, 0, LONG_MAX, 0);
 
-        for(int i=0;i<nNumFiles;i++)
-        {
-            wchar_t szFilename[MAX_PATH];
-            DragQueryFile(hDrop, i, szFilename, MAX_PATH);
+        //有时间预算时从拖入开始计时，扫描和估计的时间也算在内
+        deadline = time_budget>0 ? GetSeconds() + time_budget : 0;
 
-            if( GetFileAttributes(szFilename) & FILE_ATTRIBUTE_DIRECTORY)
-            {
-                FindFileInDir(szFilename, 1);
-            }
-            else
-            {
-                //
-                AppendFiles(szFilename);
-            }
+        //扫描和压缩同时进行，找到的文件马上进入流水线。有时间预算时要先扫描完，排好顺序再压缩
+        StartScan(hDrop);
+        if(time_budget>0)
+        {
+            PlanFiles();
         }
 
-        SendMessage(Progressbar, PBM_SETRANGE, 0, (LPARAM)(MAKELPARAM(0,files_num)));
+        //每个文件占100格，压缩过程中逐步前进
+        SendMessage(Progressbar, PBM_SETRANGE32, 0, GetFilesNum()*100);
         SendMessage(Progressbar, PBM_SETPOS, 0, 0);
 
         bool save_bak = Button_GetCheck(check_box);
-        for(int i=0;i<files_num;i++)
+        RunPipeline(save_bak);
+        FinishScan();
+        CloseHandle(files_found);
+        files_found = 0;
+        bool skipped = false;
+        for(int i=0;i<manifests_num;i++)
         {
-            MinifyPNG(list_box, files[i].file_name, save_bak);
-            SendMessage(Progressbar,PBM_SETPOS,i+1,0);
+            skipped = skipped || manifests[i]->skipped>0;
         }
-        if(files_num==0)
+        SaveManifests();
+        if(files_num==0 && !skipped)
         {
             ListBox_AddString(list_box, L"未找到PNG文件。");
             ListBox_AddString(list_box, L"");
@@ -173,11 +1307,107 @@ BOOL CALLBACK DlgMain(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
         int argCount;
 
         szArgList = CommandLineToArgvW(GetCommandLine(), &argCount);
-        if(argCount!=1)
+
+        //--backupdir=目录：备份放到这个目录下。--idatsize=字节数：每个IDAT数据块的最大长度。
+        //--include=通配符和--exclude=通配符：扫描目录时要压缩和要跳过的文件，多个用;分隔。--followlinks：进入符号链接和目录联接。
+        //--scanthreads=个数：扫描目录的线程数。--manifest：在拖入的目录里保存清单，下次跳过没有变化的文件。
+        //--mark：在压缩后的文件里加上标记，下次用相同的选项时跳过。--mingain=百分比：估计能减小的不到这个值的文件跳过。
+        //--budget=秒数：总的时间预算，先压缩每秒能减小最多字节的文件，到时间就停下。
+        //--threads=个数：压缩线程数，默认按处理器个数和可用内存。--prefetch=个数：超出压缩线程数预读的文件数。
+        //--sync：写出的文件先刷到磁盘再替换原文件。
+        //--fasthints：用扫描行跨度和像素大小作为匹配距离提示，快一些但文件一般会大一点。
+        //其余的参数是要压缩的文件或目录
+        int fileCount = 0;
+        for(int i=1;i<argCount;i++)
+        {
+            if(wcsncmp(szArgList[i], L"--backupdir=", 12)==0)
+            {
+                backup_dir = FullPath(szArgList[i] + 12);
+                szArgList[i] = 0;
+            }
+            else if(wcsncmp(szArgList[i], L"--include=", 10)==0)
+            {
+                include_glob = szArgList[i] + 10;
+                szArgList[i] = 0;
+            }
+            else if(wcsncmp(szArgList[i], L"--exclude=", 10)==0)
+            {
+                exclude_glob = szArgList[i] + 10;
+                szArgList[i] = 0;
+            }
+            else if(wcscmp(szArgList[i], L"--manifest")==0)
+            {
+                use_manifest = true;
+                szArgList[i] = 0;
+            }
+            else if(wcscmp(szArgList[i], L"--followlinks")==0)
+            {
+                follow_links = true;
+                szArgList[i] = 0;
+            }
+            else if(wcsncmp(szArgList[i], L"--scanthreads=", 14)==0)
+            {
+                int threads = _wtoi(szArgList[i] + 14);
+                if(threads>0 && threads<=MAXIMUM_WAIT_OBJECTS) scan_threads = threads;
+                szArgList[i] = 0;
+            }
+            else if(wcscmp(szArgList[i], L"--mark")==0)
+            {
+                mark_output = true;
+                szArgList[i] = 0;
+            }
+            else if(wcsncmp(szArgList[i], L"--mingain=", 10)==0)
+            {
+                double gain = _wtof(szArgList[i] + 10);
+                if(gain>=0 && gain<100) min_gain = gain;
+                szArgList[i] = 0;
+            }
+            else if(wcsncmp(szArgList[i], L"--budget=", 9)==0)
+            {
+                double budget = _wtof(szArgList[i] + 9);
+                if(budget>0) time_budget = budget;
+                szArgList[i] = 0;
+            }
+            else if(wcsncmp(szArgList[i], L"--threads=", 10)==0)
+            {
+                int threads = _wtoi(szArgList[i] + 10);
+                if(threads>0 && threads<MAXIMUM_WAIT_OBJECTS) compress_threads = threads;
+                szArgList[i] = 0;
+            }
+            else if(wcsncmp(szArgList[i], L"--prefetch=", 11)==0)
+            {
+                int files = _wtoi(szArgList[i] + 11);
+                if(files>=0) prefetch_files = files;
+                szArgList[i] = 0;
+            }
+            else if(wcscmp(szArgList[i], L"--sync")==0)
+            {
+                sync_output = true;
+                szArgList[i] = 0;
+            }
+            else if(wcscmp(szArgList[i], L"--fasthints")==0)
+            {
+                fast_hints = true;
+                szArgList[i] = 0;
+            }
+            else if(wcsncmp(szArgList[i], L"--idatsize=", 11)==0)
+            {
+                int size = _wtoi(szArgList[i] + 11);
+                if(size>0) idat_chunk_size = size;
+                szArgList[i] = 0;
+            }
+            else
+            {
+                fileCount++;
+            }
+        }
+
+        if(fileCount>0)
         {
             DWORD bufsize = sizeof(DROPFILES);
             for(int i=1;i<argCount;i++)
             {
+                if(!szArgList[i]) continue;
                 bufsize += ( wcslen(szArgList[i])*2 + 2);
             }
             bufsize+=2;
@@ -194,6 +1424,7 @@ BOOL CALLBACK DlgMain(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
             int offset = sizeof(DROPFILES);
             for(int i=1;i<argCount;i++)
             {
+                if(!szArgList[i]) continue;
                 int len = wcslen(szArgList[i])*2 + 2;
                 memcpy(buf+offset,szArgList[i], len);
                 offset += len;
@@ -233,11 +1464,16 @@ BOOL CALLBACK DlgMain(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
 
 int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nShowCmd)
 {
+    InitOptions(&options);
     options.verbose = 0;
     options.numiterations = 15;
     options.blocksplitting = 1;
     options.blocksplittinglast = 0;
     options.blocksplittingmax = 15;
+    options.progress = ProgressCallback;
+    //匹配缓存不限制时一个20MB的主块就要560MB，多个压缩线程会用光32位程序的地址空间。只影响速度，不影响压缩结果
+    options.cachememory = 64<<20;
+    InitializeCriticalSection(&files_lock);
 
     hInst=hInstance;
     InitCommonControls();
@@ -0,0 +1,158 @@
+/*
+Copyright 2011 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Author: lode.vandevenne@gmail.com (Lode Vandevenne)
+Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
+*/
+
+#include "arena.h"
+
+#include <assert.h>
+
+/*
+Minimum size of the chunks taken from the allocator. Larger allocations, such
+as the longest match cache, get a chunk of their own.
+*/
+#define ARENA_CHUNK_SIZE (4 << 20)
+
+/*
+Largest chunk that is kept as spare when released, rather than given back to
+the allocator right away. The scratch memory of every squeeze iteration is
+released and allocated again, this avoids going to the allocator for that.
+*/
+#define ARENA_MAX_SPARE (64 << 20)
+
+/* Alignment of all allocations, enough for any type used by zopfli. */
+#define ARENA_ALIGN 16
+
+struct ArenaChunk {
+  ArenaChunk* prev;  /* The chunk that was current before this one, or 0. */
+  size_t size;  /* Bytes available after the header. */
+  size_t offset;  /* Bytes handed out so far. */
+  size_t total;  /* Bytes taken from the allocator for this chunk. */
+};
+
+/* Size of the chunk header, rounded up to keep the data aligned. */
+#define ARENA_HEADER \
+    ((sizeof(ArenaChunk) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN)
+
+static void* DefaultAllocate(size_t size, void* context) {
+  (void)context;
+  return malloc(size);
+}
+
+static void DefaultDeallocate(void* ptr, void* context) {
+  (void)context;
+  free(ptr);
+}
+
+static const Allocator kDefaultAllocator = {
+  DefaultAllocate, DefaultDeallocate, 0
+};
+
+void InitArena(const Allocator* allocator, jmp_buf* failure, Arena* arena) {
+  arena->allocator = allocator ? allocator : &kDefaultAllocator;
+  arena->failure = failure;
+  arena->chunk = 0;
+  arena->spare = 0;
+  arena->used = 0;
+  arena->peak = 0;
+}
+
+/* Gives the chunk back to the allocator. */
+static void FreeArenaChunk(Arena* arena, ArenaChunk* chunk) {
+  arena->used -= chunk->total;
+  arena->allocator->deallocate(chunk, arena->allocator->context);
+}
+
+/*
+Removes the current chunk. It is kept as the spare chunk if it is not too
+large, the previous spare is freed.
+*/
+static void PopArenaChunk(Arena* arena) {
+  ArenaChunk* chunk = arena->chunk;
+  arena->chunk = chunk->prev;
+  if (chunk->size <= ARENA_MAX_SPARE) {
+    if (arena->spare) FreeArenaChunk(arena, arena->spare);
+    arena->spare = chunk;
+  } else {
+    FreeArenaChunk(arena, chunk);
+  }
+}
+
+void CleanArena(Arena* arena) {
+  while (arena->chunk) PopArenaChunk(arena);
+  if (arena->spare) FreeArenaChunk(arena, arena->spare);
+  arena->spare = 0;
+}
+
+void ArenaOutOfMemory(Arena* arena) {
+  longjmp(*arena->failure, 1);
+}
+
+void* ArenaTryAllocate(Arena* arena, size_t size) {
+  ArenaChunk* chunk = arena->chunk;
+  void* result;
+
+  size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+  if (!chunk || chunk->size - chunk->offset < size) {
+    if (arena->spare && arena->spare->size >= size) {
+      chunk = arena->spare;
+      arena->spare = 0;
+    } else {
+      size_t chunksize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+      size_t total = ARENA_HEADER + chunksize;
+      if (total < size) return 0;  /* Overflow. */
+      chunk = (ArenaChunk*)arena->allocator->allocate(
+          total, arena->allocator->context);
+      if (!chunk) return 0;
+      chunk->size = chunksize;
+      chunk->total = total;
+      arena->used += total;
+      if (arena->used > arena->peak) arena->peak = arena->used;
+    }
+    chunk->prev = arena->chunk;
+    chunk->offset = 0;
+    arena->chunk = chunk;
+  }
+
+  result = (unsigned char*)chunk + ARENA_HEADER + chunk->offset;
+  chunk->offset += size;
+  return result;
+}
+
+void* ArenaAllocate(Arena* arena, size_t size) {
+  void* result = ArenaTryAllocate(arena, size);
+  if (!result) ArenaOutOfMemory(arena);
+  return result;
+}
+
+ArenaMark GetArenaMark(const Arena* arena) {
+  ArenaMark mark;
+  mark.chunk = arena->chunk;
+  mark.offset = arena->chunk ? arena->chunk->offset : 0;
+  return mark;
+}
+
+void ReleaseArena(Arena* arena, ArenaMark mark) {
+  while (arena->chunk != mark.chunk) {
+    assert(arena->chunk);
+    PopArenaChunk(arena);
+  }
+  if (arena->chunk) {
+    assert(arena->chunk->offset >= mark.offset);
+    arena->chunk->offset = mark.offset;
+  }
+}
@@ -0,0 +1,133 @@
+/*
+Copyright 2011 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Author: lode.vandevenne@gmail.com (Lode Vandevenne)
+Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
+*/
+
+/*
+Memory arena for the working memory of one compression job.
+*/
+
+#ifndef ZOPFLI_ARENA_H_
+#define ZOPFLI_ARENA_H_
+
+#include <setjmp.h>
+#include <stdlib.h>
+
+#include "util.h"
+
+typedef struct ArenaChunk ArenaChunk;
+
+/*
+Hands out memory by bumping a pointer through large chunks taken from the
+allocator. Memory is never freed individually: ReleaseArena frees everything
+allocated after a mark at once, and CleanArena gives all memory back when the
+job ends.
+If the allocator runs out of memory, the arena jumps to the failure jmp_buf, so
+that the job can be abandoned from any depth without leaking: everything it
+allocated belongs to the arena.
+*/
+typedef struct Arena {
+  const Allocator* allocator;
+  jmp_buf* failure;  /* Where to jump when out of memory. */
+  ArenaChunk* chunk;  /* The chunk allocations are taken from, or 0. */
+  ArenaChunk* spare;  /* A released chunk kept for reuse, or 0. */
+  size_t used;  /* Bytes currently taken from the allocator. */
+  size_t peak;  /* Largest value of used so far. */
+} Arena;
+
+/* A position in the arena to release back to, see GetArenaMark. */
+typedef struct ArenaMark {
+  ArenaChunk* chunk;
+  size_t offset;
+} ArenaMark;
+
+/*
+Initializes an empty arena. allocator: where to take the memory from, or 0 to
+use malloc and free. failure: where to longjmp to with value 1 when out of
+memory.
+*/
+void InitArena(const Allocator* allocator, jmp_buf* failure, Arena* arena);
+
+/* Gives all memory of the arena back to the allocator. */
+void CleanArena(Arena* arena);
+
+/*
+Returns size bytes of uninitialized memory, aligned for any type. Does not
+return if out of memory.
+*/
+void* ArenaAllocate(Arena* arena, size_t size);
+
+/*
+Like ArenaAllocate, but returns 0 if out of memory, so that the caller can free
+what it owns outside the arena before abandoning the job.
+*/
+void* ArenaTryAllocate(Arena* arena, size_t size);
+
+/* Returns the current position, to release everything allocated after it. */
+ArenaMark GetArenaMark(const Arena* arena);
+
+/* Frees all memory allocated after the mark was taken. */
+void ReleaseArena(Arena* arena, ArenaMark mark);
+
+/* Abandons the job because memory ran out, see Arena. */
+void ArenaOutOfMemory(Arena* arena);
+
+/*
+Like APPEND_DATA, but if the array cannot grow, frees it and abandons the job
+through ArenaOutOfMemory. The array itself is not in the arena, so it would leak
+otherwise.
+*/
+#ifdef __cplusplus /* C++ cannot assign void* from malloc to *data */
+#define ARENA_APPEND_DATA(/* T */ value, /* T** */ data, /* size_t* */ size,\
+                          /* Arena* */ arena) {\
+  if (!((*size) & ((*size) - 1))) {\
+    /*double alloc size if it's a power of two*/\
+    void** data_void = reinterpret_cast<void**>(data);\
+    void* grown = (*size) == 0 ? malloc(sizeof(**data))\
+                               : realloc((*data), (*size) * 2 * sizeof(**data));\
+    if (!grown) {\
+      free(*data);\
+      *data = 0;\
+      *size = 0;\
+      ArenaOutOfMemory(arena);\
+    }\
+    *data_void = grown;\
+  }\
+  (*data)[(*size)] = (value);\
+  (*size)++;\
+}
+#else /* C gives problems with strict-aliasing rules for (void**) cast */
+#define ARENA_APPEND_DATA(/* T */ value, /* T** */ data, /* size_t* */ size,\
+                          /* Arena* */ arena) {\
+  if (!((*size) & ((*size) - 1))) {\
+    /*double alloc size if it's a power of two*/\
+    void* grown = (*size) == 0 ? malloc(sizeof(**data))\
+                               : realloc((*data), (*size) * 2 * sizeof(**data));\
+    if (!grown) {\
+      free(*data);\
+      *data = 0;\
+      *size = 0;\
+      ArenaOutOfMemory(arena);\
+    }\
+    (*data) = grown;\
+  }\
+  (*data)[(*size)] = (value);\
+  (*size)++;\
+}
+#endif
+
+#endif  /* ZOPFLI_ARENA_H_ */
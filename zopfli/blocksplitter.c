@@ -23,6 +23,7 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "arena.h"
 #include "deflate.h"
 #include "lz77.h"
 #include "squeeze.h"
@@ -127,9 +128,10 @@ static double SplitCost(size_t i, void* context) {
       EstimateCost(c->litlens, c->dists, i, c->end);
 }
 
-static void AddSorted(size_t value, size_t** out, size_t* outsize) {
+static void AddSorted(Arena* arena,
+                      size_t value, size_t** out, size_t* outsize) {
   size_t i;
-  APPEND_DATA(value, out, outsize);
+  ARENA_APPEND_DATA(value, out, outsize, arena);
   if (*outsize > 0) {
     for (i = 0; i < *outsize - 1; i++) {
       if ((*out)[i] > value) {
@@ -151,35 +153,26 @@ static void PrintBlockSplitPoints(const unsigned short* litlens,
                                   const unsigned short* dists,
                                   size_t llsize, const size_t* lz77splitpoints,
                                   size_t nlz77points) {
-  size_t* splitpoints = 0;
-  size_t npoints = 0;
-  size_t i;
-  /* The input is given as lz77 indices, but we want to see the uncompressed
-  index values. */
-  size_t pos = 0;
-  if (nlz77points > 0) {
-    for (i = 0; i < llsize; i++) {
-      size_t length = dists[i] == 0 ? 1 : litlens[i];
+  int hex;
+  fprintf(stderr, "block split points: ");
+  for (hex = 0; hex <= 1; hex++) {
+    /* The input is given as lz77 indices, but we want to see the uncompressed
+    index values. They are worked out for each list again rather than stored,
+    because nothing may be allocated while the caller owns the split points. */
+    size_t pos = 0;
+    size_t npoints = 0;
+    size_t i;
+    if (hex) fprintf(stderr, "(hex:");
+    for (i = 0; i < llsize && npoints < nlz77points; i++) {
       if (lz77splitpoints[npoints] == i) {
-        APPEND_DATA(pos, &splitpoints, &npoints);
-        if (npoints == nlz77points) break;
+        fprintf(stderr, hex ? " %x" : "%d ", (int)pos);
+        npoints++;
       }
-      pos += length;
+      pos += dists[i] == 0 ? 1 : litlens[i];
     }
-  }
-  assert(npoints == nlz77points);
-
-  fprintf(stderr, "block split points: ");
-  for (i = 0; i < npoints; i++) {
-    fprintf(stderr, "%d ", (int)splitpoints[i]);
-  }
-  fprintf(stderr, "(hex:");
-  for (i = 0; i < npoints; i++) {
-    fprintf(stderr, " %x", (int)splitpoints[i]);
+    assert(npoints == nlz77points);
   }
   fprintf(stderr, ")\n");
-
-  free(splitpoints);
 }
 
 /*
@@ -225,11 +218,12 @@ void BlockSplitLZ77(const Options* options,
   size_t numblocks = 1;
   unsigned char* done;
   double splitcost, origcost;
+  ArenaMark mark;
 
   if (llsize < 10) return;  /* This code fails on tiny files. */
 
-  done = (unsigned char*)malloc(llsize);
-  if (!done) exit(-1); /* Allocation failed. */
+  mark = GetArenaMark(options->arena);
+  done = (unsigned char*)ArenaAllocate(options->arena, llsize);
   for (i = 0; i < llsize; i++) done[i] = 0;
 
   lstart = 0;
@@ -240,6 +234,7 @@ void BlockSplitLZ77(const Options* options,
     if (maxblocks > 0 && numblocks >= maxblocks) {
       break;
     }
+    if (PollProgress(options)) break;
 
     c.litlens = litlens;
     c.dists = dists;
@@ -259,7 +254,7 @@ void BlockSplitLZ77(const Options* options,
     if (splitcost > origcost || llpos == lstart + 1 || llpos == lend) {
       done[lstart] = 1;
     } else {
-      AddSorted(llpos, splitpoints, npoints);
+      AddSorted(options->arena, llpos, splitpoints, npoints);
       numblocks++;
     }
 
@@ -277,7 +272,7 @@ void BlockSplitLZ77(const Options* options,
     PrintBlockSplitPoints(litlens, dists, llsize, *splitpoints, *npoints);
   }
 
-  free(done);
+  ReleaseArena(options->arena, mark);
 }
 
 void BlockSplit(const Options* options,
@@ -289,15 +284,11 @@ void BlockSplit(const Options* options,
   size_t* lz77splitpoints = 0;
   size_t nlz77points = 0;
   LZ77Store store;
+  ArenaMark mark = GetArenaMark(options->arena);
 
-  InitLZ77Store(&store);
+  InitLZ77Store(options->arena, &store);
 
-  s.options = options;
-  s.blockstart = instart;
-  s.blockend = inend;
-#ifdef USE_LONGEST_MATCH_CACHE
-  s.lmc = 0;
-#endif
+  InitBlockState(options, instart, inend, 0, &s);
 
   *npoints = 0;
   *splitpoints = 0;
@@ -309,29 +300,32 @@ void BlockSplit(const Options* options,
   BlockSplitLZ77(options, store.litlens, store.dists, store.size, maxblocks,
                  &lz77splitpoints, &nlz77points);
 
-  /* Convert LZ77 positions to positions in the uncompressed input. */
+  /* Convert LZ77 positions to positions in the uncompressed input. This is done
+  in place, so that no allocation can fail while two arrays are owned. */
   pos = instart;
   if (nlz77points > 0) {
     for (i = 0; i < store.size; i++) {
       size_t length = store.dists[i] == 0 ? 1 : store.litlens[i];
       if (lz77splitpoints[*npoints] == i) {
-        APPEND_DATA(pos, splitpoints, npoints);
+        lz77splitpoints[(*npoints)++] = pos;
         if (*npoints == nlz77points) break;
       }
       pos += length;
     }
   }
   assert(*npoints == nlz77points);
+  *splitpoints = lz77splitpoints;
 
-  free(lz77splitpoints);
-  CleanLZ77Store(&store);
+  CleanBlockState(&s);
+  ReleaseArena(options->arena, mark);
 }
 
-void BlockSplitSimple(const unsigned char* in, size_t instart, size_t inend,
+void BlockSplitSimple(Arena* arena,
+                      const unsigned char* in, size_t instart, size_t inend,
                       size_t blocksize, size_t** splitpoints, size_t* npoints) {
   size_t i = instart;
   while (i < inend) {
-    APPEND_DATA(i, splitpoints, npoints);
+    ARENA_APPEND_DATA(i, splitpoints, npoints, arena);
     i += blocksize;
   }
   (void)in;
@@ -66,9 +66,10 @@ void BlockSplit(const Options* options,
 
 /*
 Divides the input into equal blocks, does not even take LZ77 lengths into
-account.
+account. Out of memory abandons the job through the arena.
 */
-void BlockSplitSimple(const unsigned char* in, size_t instart, size_t inend,
+void BlockSplitSimple(struct Arena* arena,
+                      const unsigned char* in, size_t instart, size_t inend,
                       size_t blocksize, size_t** splitpoints, size_t* npoints);
 
 #endif  /* ZOPFLI_BLOCKSPLITTER_H_ */
@@ -25,24 +25,40 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 
 #ifdef USE_LONGEST_MATCH_CACHE
 
-void InitLongestMatchCache(size_t blocksize, LongestMatchCache* lmc) {
+void InitLongestMatchCache(size_t blocksize, int cachedlengths,
+                           size_t maxmemory, Arena* arena,
+                           LongestMatchCache* lmc) {
   size_t i;
-  lmc->length = (unsigned short*)malloc(sizeof(unsigned short) * blocksize);
-  lmc->dist = (unsigned short*)malloc(sizeof(unsigned short) * blocksize);
+  size_t positions = blocksize;
+  assert(cachedlengths >= 0 && cachedlengths <= 256);
+
+  if (maxmemory > 0) {
+    /* First give up cached lengths, they take most of the memory, then the
+    positions at the end of the block. */
+    size_t perposition = maxmemory / (blocksize ? blocksize : 1);
+    if (perposition < 4 + 3 * (size_t)cachedlengths) {
+      cachedlengths = perposition < 4 ? 0 : (int)((perposition - 4) / 3);
+    }
+    if (perposition < 4) positions = maxmemory / 4;
+  }
+
+  lmc->cachedlengths = cachedlengths;
+  lmc->positions = positions;
+  lmc->lookups = 0;
+  lmc->hits = 0;
+  lmc->length = (unsigned short*)ArenaAllocate(arena,
+      sizeof(unsigned short) * positions);
+  lmc->dist = (unsigned short*)ArenaAllocate(arena,
+      sizeof(unsigned short) * positions);
   /* Rather large amount of memory. */
-  lmc->sublen = (unsigned char*)malloc(NUM_CACHED_LENGTHS * 3 * blocksize);
+  lmc->sublen = (unsigned char*)ArenaAllocate(arena,
+      lmc->cachedlengths * 3 * positions);
 
   /* length > 0 and dist 0 is invalid combination, which indicates on purpose
   that this cache value is not filled in yet. */
-  for (i = 0; i < blocksize; i++) lmc->length[i] = 1;
-  for (i = 0; i < blocksize; i++) lmc->dist[i] = 0;
-  for (i = 0; i < NUM_CACHED_LENGTHS * blocksize * 3; i++) lmc->sublen[i] = 0;
-}
-
-void CleanLongestMatchCache(LongestMatchCache* lmc) {
-  free(lmc->length);
-  free(lmc->dist);
-  free(lmc->sublen);
+  for (i = 0; i < positions; i++) lmc->length[i] = 1;
+  memset(lmc->dist, 0, sizeof(unsigned short) * positions);
+  memset(lmc->sublen, 0, lmc->cachedlengths * 3 * positions);
 }
 
 void SublenToCache(const unsigned short* sublen, size_t pos, size_t length,
@@ -52,11 +68,9 @@ void SublenToCache(const unsigned short* sublen, size_t pos, size_t length,
   unsigned bestlength = 0;
   unsigned char* cache;
 
-#if NUM_CACHED_LENGTHS == 0
-  return;
-#endif
+  if (lmc->cachedlengths == 0) return;
 
-  cache = &lmc->sublen[NUM_CACHED_LENGTHS * pos * 3];
+  cache = &lmc->sublen[lmc->cachedlengths * pos * 3];
   if (length < 3) return;
   for (i = 3; i <= length; i++) {
     if (i == length || sublen[i] != sublen[i + 1]) {
@@ -65,12 +79,12 @@ void SublenToCache(const unsigned short* sublen, size_t pos, size_t length,
       cache[j * 3 + 2] = (sublen[i] >> 8) % 256;
       bestlength = i;
       j++;
-      if (j >= NUM_CACHED_LENGTHS) break;
+      if (j >= lmc->cachedlengths) break;
     }
   }
-  if (j < NUM_CACHED_LENGTHS) {
+  if (j < lmc->cachedlengths) {
     assert(bestlength == length);
-    cache[(NUM_CACHED_LENGTHS - 1) * 3] = bestlength - 3;
+    cache[(lmc->cachedlengths - 1) * 3] = bestlength - 3;
   } else {
     assert(bestlength <= length);
   }
@@ -83,12 +97,10 @@ void CacheToSublen(const LongestMatchCache* lmc, size_t pos, size_t length,
   unsigned maxlength = MaxCachedSublen(lmc, pos, length);
   unsigned prevlength = 0;
   unsigned char* cache;
-#if NUM_CACHED_LENGTHS == 0
-  return;
-#endif
+  if (lmc->cachedlengths == 0) return;
   if (length < 3) return;
-  cache = &lmc->sublen[NUM_CACHED_LENGTHS * pos * 3];
-  for (j = 0; j < NUM_CACHED_LENGTHS; j++) {
+  cache = &lmc->sublen[lmc->cachedlengths * pos * 3];
+  for (j = 0; j < lmc->cachedlengths; j++) {
     unsigned length = cache[j * 3] + 3;
     unsigned dist = cache[j * 3 + 1] + 256 * cache[j * 3 + 2];
     for (i = prevlength; i <= length; i++) {
@@ -105,13 +117,11 @@ Returns the length up to which could be stored in the cache.
 unsigned MaxCachedSublen(const LongestMatchCache* lmc,
                          size_t pos, size_t length) {
   unsigned char* cache;
-#if NUM_CACHED_LENGTHS == 0
-  return 0;
-#endif
-  cache = &lmc->sublen[NUM_CACHED_LENGTHS * pos * 3];
+  if (lmc->cachedlengths == 0) return 0;
+  cache = &lmc->sublen[lmc->cachedlengths * pos * 3];
   (void)length;
   if (cache[1] == 0 && cache[2] == 0) return 0;  /* No sublen cached. */
-  return cache[(NUM_CACHED_LENGTHS - 1) * 3] + 3;
+  return cache[(lmc->cachedlengths - 1) * 3] + 3;
 }
 
 #endif  /* USE_LONGEST_MATCH_CACHE */
@@ -24,6 +24,7 @@ The cache that speeds up FindLongestMatch of lz77.c.
 #ifndef ZOPFLI_CACHE_H_
 #define ZOPFLI_CACHE_H_
 
+#include "arena.h"
 #include "util.h"
 
 #ifdef USE_LONGEST_MATCH_CACHE
@@ -39,13 +40,23 @@ typedef struct LongestMatchCache {
   unsigned short* length;
   unsigned short* dist;
   unsigned char* sublen; /* For each length, the distance */
-} LongestMatchCache;
+  size_t cachedlengths;  /* Amount of lengths in sublen per position. */
+  size_t positions;  /* Amount of positions from the block start cached. */
 
-/* Initializes the LongestMatchCache. */
-void InitLongestMatchCache(size_t blocksize, LongestMatchCache* lmc);
+  /* Counters for CompressionStats, see Options.cachememory. */
+  size_t lookups;
+  size_t hits;
+} LongestMatchCache;
 
-/* Frees up the memory of the LongestMatchCache. */
-void CleanLongestMatchCache(LongestMatchCache* lmc);
+/*
+Initializes the LongestMatchCache. The memory belongs to the arena.
+cachedlengths: see Options.cachedlengths.
+maxmemory: see Options.cachememory. The cache holds fewer lengths, or fewer
+    positions, to stay within it.
+*/
+void InitLongestMatchCache(size_t blocksize, int cachedlengths,
+                           size_t maxmemory, Arena* arena,
+                           LongestMatchCache* lmc);
 
 /* Stores sublen array in the cache. */
 void SublenToCache(const unsigned short* sublen, size_t pos, size_t length,
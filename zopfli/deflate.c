@@ -20,47 +20,158 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "deflate.h"
 
 #include <assert.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "arena.h"
 #include "blocksplitter.h"
 #include "lz77.h"
 #include "squeeze.h"
 #include "tree.h"
 
-static void AddBit(int bit,
-                   unsigned char* bp, unsigned char** out, size_t* outsize) {
-  if (((*bp) & 7) == 0) APPEND_DATA(0, out, outsize);
-  (*out)[*outsize - 1] |= bit << ((*bp) & 7);
-  (*bp)++;
+/*
+Amount of bits in the bit writer accumulator, and the amount that is flushed at
+once. A single AddBits call adds at most BITWRITER_FLUSH bits, which is enough
+for any Huffman code (max 15 bits) or extra bits value (max 13 bits).
+*/
+#define BITWRITER_BITS (sizeof(size_t) * 8)
+#define BITWRITER_FLUSH (BITWRITER_BITS / 2)
+
+/*
+Writes bits into the dynamic output array. Bits are gathered in a machine word
+and flushed to the output as half words at once. The output space is reserved by
+InitBitWriter, so that adding symbols never reallocates.
+*/
+typedef struct BitWriter {
+  unsigned char* bp;  /* Bit pointer of the output, set by FlushBitWriter. */
+  unsigned char** out;
+  size_t* outsize;
+  size_t bits;  /* Pending bits, the first one in the least significant bit. */
+  unsigned nbits;  /* Amount of pending bits, less than BITWRITER_FLUSH. */
+  size_t maxsize;  /* Amount of bytes reserved in out, for assertion. */
+} BitWriter;
+
+/*
+Returns the smallest power of two that is at least size, which is the
+allocation size APPEND_DATA uses for an array of that size.
+*/
+static size_t AllocationSize(size_t size) {
+  size_t result = 1;
+  while (result < size) result *= 2;
+  return result;
 }
 
-static void AddBits(unsigned symbol, unsigned length,
-                    unsigned char* bp, unsigned char** out, size_t* outsize) {
-  /* TODO(lode): make more efficient (add more bits at once). */
-  unsigned i;
-  for (i = 0; i < length; i++) {
-    unsigned bit = (symbol >> i) & 1;
-    if (((*bp) & 7) == 0) APPEND_DATA(0, out, outsize);
-    (*out)[*outsize - 1] |= bit << ((*bp) & 7);
-    (*bp)++;
+/*
+Makes sure that amount more bytes can be added to the dynamic output array
+without reallocating. The allocation stays a power of two, so APPEND_DATA can
+still be used on the array afterwards.
+arena: the arena of the job, abandoned when out of memory.
+*/
+static void ReserveOutput(size_t amount, Arena* arena,
+                          unsigned char** out, size_t* outsize) {
+  size_t current = *outsize == 0 ? 0 : AllocationSize(*outsize);
+  size_t wanted = AllocationSize(*outsize + amount);
+  unsigned char* data;
+  if (amount == 0 || wanted <= current) return;
+  data = (unsigned char*)realloc(*out, wanted);
+  if (!data) {
+    /* The output array stays valid, the caller frees it. */
+    ArenaOutOfMemory(arena);
+  }
+  *out = data;
+}
+
+int FlushOutput(const Options* options, unsigned char bp,
+                unsigned char** out, size_t* outsize) {
+  size_t finished = (bp & 7) ? *outsize - 1 : *outsize;
+  unsigned char partial;
+  int cancel;
+  if (!options->output || finished == 0) return 0;
+  cancel = options->output(*out, finished, options->outputcontext);
+  if (cancel && options->progressstate) options->progressstate->cancelled = 1;
+
+  /* The allocation size follows from the array size, so start a new array
+  rather than shrinking this one. */
+  partial = (bp & 7) ? (*out)[finished] : 0;
+  free(*out);
+  *out = 0;
+  *outsize = 0;
+  if (bp & 7) {
+    ReserveOutput(1, options->arena, out, outsize);
+    (*out)[(*outsize)++] = partial;
   }
+  return cancel;
 }
 
 /*
-Adds bits, like AddBits, but the order is inverted. The deflate specification
-uses both orders in one standard.
+Starts writing at most maxbits bits to the output. If the last byte of the
+output is only partially filled according to bp, the writer continues in it.
 */
-static void AddHuffmanBits(unsigned symbol, unsigned length,
-                           unsigned char* bp, unsigned char** out,
-                           size_t* outsize) {
-  /* TODO(lode): make more efficient (add more bits at once). */
-  unsigned i;
-  for (i = 0; i < length; i++) {
-    unsigned bit = (symbol >> (length - i - 1)) & 1;
-    if (((*bp) & 7) == 0) APPEND_DATA(0, out, outsize);
-    (*out)[*outsize - 1] |= bit << ((*bp) & 7);
-    (*bp)++;
+static void InitBitWriter(size_t maxbits, Arena* arena, unsigned char* bp,
+                          unsigned char** out, size_t* outsize,
+                          BitWriter* w) {
+  ReserveOutput(maxbits / 8 + 1, arena, out, outsize);
+  w->bp = bp;
+  w->out = out;
+  w->outsize = outsize;
+  w->bits = 0;
+  w->nbits = 0;
+  if ((*bp) & 7) {
+    (*outsize)--;
+    w->nbits = (*bp) & 7;
+    w->bits = (*out)[*outsize] & ((1u << w->nbits) - 1);
+  }
+  w->maxsize = *outsize + (w->nbits + maxbits + 7) / 8;
+}
+
+/* Adds the length lowest bits of symbol, least significant bit first. */
+static void AddBits(unsigned symbol, unsigned length, BitWriter* w) {
+  assert(length <= BITWRITER_FLUSH);
+  w->bits |= (size_t)symbol << w->nbits;
+  w->nbits += length;
+  if (w->nbits >= BITWRITER_FLUSH) {
+    unsigned char* data = *w->out + *w->outsize;
+    unsigned i;
+    assert(*w->outsize + BITWRITER_FLUSH / 8 <= w->maxsize);
+    for (i = 0; i < BITWRITER_FLUSH / 8; i++) {
+      data[i] = (unsigned char)(w->bits >> (i * 8));
+    }
+    *w->outsize += BITWRITER_FLUSH / 8;
+    w->bits >>= BITWRITER_FLUSH;
+    w->nbits -= BITWRITER_FLUSH;
+  }
+}
+
+/*
+Writes out all pending bits, the last byte possibly partially, and sets the bit
+pointer accordingly.
+*/
+static void FlushBitWriter(BitWriter* w) {
+  *w->bp = w->nbits & 7;
+  while (w->nbits > 0) {
+    assert(*w->outsize < w->maxsize);
+    (*w->out)[(*w->outsize)++] = (unsigned char)w->bits;
+    w->bits >>= 8;
+    w->nbits = w->nbits > 8 ? w->nbits - 8 : 0;
+  }
+}
+
+/*
+Reverses the bits of the Huffman codes. Deflate stores Huffman codes starting
+with their most significant bit, unlike all other values, so with reversed codes
+a symbol can be added with a single AddBits call.
+*/
+static void ReverseSymbols(const unsigned* lengths, size_t n,
+                           unsigned* symbols) {
+  size_t i;
+  for (i = 0; i < n; i++) {
+    unsigned reversed = 0;
+    unsigned j;
+    for (j = 0; j < lengths[i]; j++) {
+      reversed = (reversed << 1) | ((symbols[i] >> j) & 1);
+    }
+    symbols[i] = reversed;
   }
 }
 
@@ -92,56 +203,54 @@ static void PatchDistanceCodesForBuggyDecoders(unsigned* d_lengths) {
 }
 
 /*
-Gives the exact size of the tree, in bits, as it will be encoded in DEFLATE.
+The tree of a dynamic block (btype 10) as it is encoded in DEFLATE: the litlen
+and dist code lengths, runlength encoded with the code length code.
 */
-size_t CalculateTreeSize(const unsigned* ll_lengths, const unsigned* d_lengths,
-                         size_t* ll_counts, size_t* d_counts) {
-  unsigned char* dummy = 0;
-  size_t dummysize = 0;
-  unsigned char bp = 0;
-
-  (void)ll_counts;
-  (void)d_counts;
-
-  AddDynamicTree(ll_lengths, d_lengths, &bp, &dummy, &dummysize);
-  free(dummy);
-
-  return dummysize * 8 + (bp & 7);
+typedef struct TreeEncoding {
+  unsigned hlit;
+  unsigned hdist;
+  unsigned hclen;
+  unsigned rle[286 + 30];  /* Runlength encoded version of lengths of litlen
+      and dist trees. */
+  unsigned rle_bits[286 + 30];  /* Extra bits for rle values 16, 17 and 18. */
+  size_t rle_size;  /* Size of rle and rle_bits arrays. */
+  unsigned clcl[19];  /* Code length code lengths. */
+} TreeEncoding;
+
+/* The order in which code length code lengths are encoded as per deflate. */
+static const unsigned kCodeLengthOrder[19] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/* Amount of extra bits of the code length code symbol. */
+static unsigned CodeLengthExtraBits(unsigned symbol) {
+  if (symbol == 16) return 2;
+  if (symbol == 17) return 3;
+  if (symbol == 18) return 7;
+  return 0;
 }
 
-void AddDynamicTree(const unsigned* ll_lengths, const unsigned* d_lengths,
-                    unsigned char* bp, unsigned char** out, size_t* outsize) {
-  unsigned* lld_lengths = 0;  /* All litlen and dist lengthts with ending zeros
-      trimmed together in one array. */
+static void EncodeTree(const unsigned* ll_lengths, const unsigned* d_lengths,
+                       TreeEncoding* t) {
+  unsigned lld_lengths[286 + 30];  /* All litlen and dist lengthts with ending
+      zeros trimmed together in one array. */
   unsigned lld_total;  /* Size of lld_lengths. */
-  unsigned* rle = 0;  /* Runlength encoded version of lengths of litlen and dist
-      trees. */
-  unsigned* rle_bits = 0;  /* Extra bits for rle values 16, 17 and 18. */
-  size_t rle_size = 0;  /* Size of rle array. */
-  size_t rle_bits_size = 0;  /* Should have same value as rle_size. */
-  unsigned hlit = 29; /* 286 - 257 */
-  unsigned hdist = 29;  /* 32 - 1, but gzip does not like hdist > 29.*/
-  unsigned hclen;
   size_t i, j;
   size_t clcounts[19];
-  unsigned clcl[19];  /* Code length code lengths. */
-  unsigned clsymbols[19];
-  /* The order in which code length code lengths are encoded as per deflate. */
-  unsigned order[19] = {
-    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
-  };
+
+  t->hlit = 29; /* 286 - 257 */
+  t->hdist = 29;  /* 32 - 1, but gzip does not like hdist > 29.*/
+  t->rle_size = 0;
 
   /* Trim zeros. */
-  while (hlit > 0 && ll_lengths[257 + hlit - 1] == 0) hlit--;
-  while (hdist > 0 && d_lengths[1 + hdist - 1] == 0) hdist--;
+  while (t->hlit > 0 && ll_lengths[257 + t->hlit - 1] == 0) t->hlit--;
+  while (t->hdist > 0 && d_lengths[1 + t->hdist - 1] == 0) t->hdist--;
 
-  lld_total = hlit + 257 + hdist + 1;
-  lld_lengths = (unsigned*)malloc(sizeof(*lld_lengths) * lld_total);
-  if (!lld_lengths) exit(-1); /* Allocation failed. */
+  lld_total = t->hlit + 257 + t->hdist + 1;
 
   for (i = 0; i < lld_total; i++) {
-    lld_lengths[i] = i < 257 + hlit
-        ? ll_lengths[i] : d_lengths[i - 257 - hlit];
+    lld_lengths[i] = i < 257 + t->hlit
+        ? ll_lengths[i] : d_lengths[i - 257 - t->hlit];
     assert(lld_lengths[i] < 16);
   }
 
@@ -154,88 +263,134 @@ void AddDynamicTree(const unsigned* ll_lengths, const unsigned* d_lengths,
       if (lld_lengths[i] == 0) {
         if (count > 10) {
           if (count > 138) count = 138;
-          APPEND_DATA(18, &rle, &rle_size);
-          APPEND_DATA(count - 11, &rle_bits, &rle_bits_size);
+          t->rle[t->rle_size] = 18;
+          t->rle_bits[t->rle_size++] = count - 11;
         } else {
-          APPEND_DATA(17, &rle, &rle_size);
-          APPEND_DATA(count - 3, &rle_bits, &rle_bits_size);
+          t->rle[t->rle_size] = 17;
+          t->rle_bits[t->rle_size++] = count - 3;
         }
       } else {
         unsigned repeat = count - 1;  /* Since the first one is hardcoded. */
-        APPEND_DATA(lld_lengths[i], &rle, &rle_size);
-        APPEND_DATA(0, &rle_bits, &rle_bits_size);
+        t->rle[t->rle_size] = lld_lengths[i];
+        t->rle_bits[t->rle_size++] = 0;
         while (repeat >= 6) {
-          APPEND_DATA(16, &rle, &rle_size);
-          APPEND_DATA(6 - 3, &rle_bits, &rle_bits_size);
+          t->rle[t->rle_size] = 16;
+          t->rle_bits[t->rle_size++] = 6 - 3;
           repeat -= 6;
         }
         if (repeat >= 3) {
-          APPEND_DATA(16, &rle, &rle_size);
-          APPEND_DATA(3 - 3, &rle_bits, &rle_bits_size);
+          t->rle[t->rle_size] = 16;
+          t->rle_bits[t->rle_size++] = 3 - 3;
           repeat -= 3;
         }
         while (repeat != 0) {
-          APPEND_DATA(lld_lengths[i], &rle, &rle_size);
-          APPEND_DATA(0, &rle_bits, &rle_bits_size);
+          t->rle[t->rle_size] = lld_lengths[i];
+          t->rle_bits[t->rle_size++] = 0;
           repeat--;
         }
       }
 
       i += count - 1;
     } else {
-      APPEND_DATA(lld_lengths[i], &rle, &rle_size);
-      APPEND_DATA(0, &rle_bits, &rle_bits_size);
+      t->rle[t->rle_size] = lld_lengths[i];
+      t->rle_bits[t->rle_size++] = 0;
     }
-    assert(rle[rle_size - 1] <= 18);
+    assert(t->rle[t->rle_size - 1] <= 18);
   }
 
   for (i = 0; i < 19; i++) {
     clcounts[i] = 0;
   }
-  for (i = 0; i < rle_size; i++) {
-    clcounts[rle[i]]++;
+  for (i = 0; i < t->rle_size; i++) {
+    clcounts[t->rle[i]]++;
   }
 
-  CalculateBitLengths(clcounts, 19, 7, clcl);
-  LengthsToSymbols(clcl, 19, 7, clsymbols);
+  CalculateBitLengths(clcounts, 19, 7, t->clcl);
 
-  hclen = 15;
+  t->hclen = 15;
   /* Trim zeros. */
-  while (hclen > 0 && clcounts[order[hclen + 4 - 1]] == 0) hclen--;
+  while (t->hclen > 0 && clcounts[kCodeLengthOrder[t->hclen + 4 - 1]] == 0) {
+    t->hclen--;
+  }
+}
+
+/* Returns the size of the encoded tree in bits. */
+static size_t TreeEncodingSize(const TreeEncoding* t) {
+  size_t result = 5 + 5 + 4 + (t->hclen + 4) * 3;
+  size_t i;
+  for (i = 0; i < t->rle_size; i++) {
+    result += t->clcl[t->rle[i]] + CodeLengthExtraBits(t->rle[i]);
+  }
+  return result;
+}
 
-  AddBits(hlit, 5, bp, out, outsize);
-  AddBits(hdist, 5, bp, out, outsize);
-  AddBits(hclen, 4, bp, out, outsize);
+static void AddTreeEncoding(const TreeEncoding* t, BitWriter* w) {
+  unsigned clsymbols[19];
+  size_t i;
 
-  for (i = 0; i < hclen + 4; i++) {
-    AddBits(clcl[order[i]], 3, bp, out, outsize);
+  LengthsToSymbols(t->clcl, 19, 7, clsymbols);
+  ReverseSymbols(t->clcl, 19, clsymbols);
+
+  AddBits(t->hlit, 5, w);
+  AddBits(t->hdist, 5, w);
+  AddBits(t->hclen, 4, w);
+
+  for (i = 0; i < t->hclen + 4; i++) {
+    AddBits(t->clcl[kCodeLengthOrder[i]], 3, w);
   }
 
-  for (i = 0; i < rle_size; i++) {
-    unsigned symbol = clsymbols[rle[i]];
-    AddHuffmanBits(symbol, clcl[rle[i]], bp, out, outsize);
+  for (i = 0; i < t->rle_size; i++) {
+    unsigned symbol = t->rle[i];
+    AddBits(clsymbols[symbol], t->clcl[symbol], w);
     /* Extra bits. */
-    if (rle[i] == 16) AddBits(rle_bits[i], 2, bp, out, outsize);
-    else if (rle[i] == 17) AddBits(rle_bits[i], 3, bp, out, outsize);
-    else if (rle[i] == 18) AddBits(rle_bits[i], 7, bp, out, outsize);
+    AddBits(t->rle_bits[i], CodeLengthExtraBits(symbol), w);
   }
+}
 
-  free(lld_lengths);
-  free(rle);
-  free(rle_bits);
+/*
+Gives the exact size of the tree, in bits, as it will be encoded in DEFLATE.
+*/
+size_t CalculateTreeSize(const unsigned* ll_lengths, const unsigned* d_lengths,
+                         size_t* ll_counts, size_t* d_counts) {
+  TreeEncoding t;
+  size_t bits;
+
+  (void)ll_counts;
+  (void)d_counts;
+
+  EncodeTree(ll_lengths, d_lengths, &t);
+  bits = TreeEncodingSize(&t);
+
+  /* All bytes including the partially used last one, plus the used bits of
+  that last byte once more. This overestimates a bit, but it is the measure the
+  block splitting has always been done with, so it is kept. */
+  return (bits + 7) / 8 * 8 + (bits & 7);
+}
+
+void AddDynamicTree(const Options* options,
+                    const unsigned* ll_lengths, const unsigned* d_lengths,
+                    unsigned char* bp, unsigned char** out, size_t* outsize) {
+  TreeEncoding t;
+  BitWriter w;
+
+  EncodeTree(ll_lengths, d_lengths, &t);
+  InitBitWriter(TreeEncodingSize(&t), options->arena, bp, out, outsize, &w);
+  AddTreeEncoding(&t, &w);
+  FlushBitWriter(&w);
 }
 
 /*
 Adds all lit/len and dist codes from the lists as huffman symbols. Does not add
 end code 256. expected_data_size is the uncompressed block size, used for
 assert, but you can set it to 0 to not do the assertion.
+ll_symbols and d_symbols must be reversed with ReverseSymbols.
 */
 void AddLZ77Data(const unsigned short* litlens, const unsigned short* dists,
                  size_t lstart, size_t lend,
                  size_t expected_data_size,
                  const unsigned* ll_symbols, const unsigned* ll_lengths,
                  const unsigned* d_symbols, const unsigned* d_lengths,
-                 unsigned char* bp, unsigned char** out, size_t* outsize) {
+                 BitWriter* w) {
   size_t testlength = 0;
   size_t i;
 
@@ -245,7 +400,7 @@ void AddLZ77Data(const unsigned short* litlens, const unsigned short* dists,
     if (dist == 0) {
       assert(litlen < 256);
       assert(ll_lengths[litlen] > 0);
-      AddHuffmanBits(ll_symbols[litlen], ll_lengths[litlen], bp, out, outsize);
+      AddBits(ll_symbols[litlen], ll_lengths[litlen], w);
       testlength++;
     } else {
       unsigned lls = GetLengthSymbol(litlen);
@@ -253,12 +408,10 @@ void AddLZ77Data(const unsigned short* litlens, const unsigned short* dists,
       assert(litlen >= 3 && litlen <= 288);
       assert(ll_lengths[lls] > 0);
       assert(d_lengths[ds] > 0);
-      AddHuffmanBits(ll_symbols[lls], ll_lengths[lls], bp, out, outsize);
-      AddBits(GetLengthExtraBitsValue(litlen), GetLengthExtraBits(litlen),
-              bp, out, outsize);
-      AddHuffmanBits(d_symbols[ds], d_lengths[ds], bp, out, outsize);
-      AddBits(GetDistExtraBitsValue(dist), GetDistExtraBits(dist),
-              bp, out, outsize);
+      AddBits(ll_symbols[lls], ll_lengths[lls], w);
+      AddBits(GetLengthExtraBitsValue(litlen), GetLengthExtraBits(litlen), w);
+      AddBits(d_symbols[ds], d_lengths[ds], w);
+      AddBits(GetDistExtraBitsValue(dist), GetDistExtraBits(dist), w);
       testlength += litlen;
     }
   }
@@ -354,31 +507,25 @@ void AddLZ77Block(const Options* options, int btype, int final,
   unsigned d_lengths[32];
   unsigned ll_symbols[288];
   unsigned d_symbols[32];
-  size_t detect_block_size = *outsize;
+  TreeEncoding tree;
+  size_t tree_size = 0;
   size_t compressed_size;
   size_t uncompressed_size = 0;
   size_t i;
-
-  AddBit(final, bp, out, outsize);
-  AddBit(btype & 1, bp, out, outsize);
-  AddBit((btype & 2) >> 1, bp, out, outsize);
+  BitWriter w;
 
   if (btype == 1) {
     /* Fixed block. */
     GetFixedTree(ll_lengths, d_lengths);
   } else {
     /* Dynamic block. */
-    unsigned detect_tree_size;
     assert(btype == 2);
     GetLZ77Counts(litlens, dists, lstart, lend, ll_counts, d_counts);
     CalculateBitLengths(ll_counts, 288, 15, ll_lengths);
     CalculateBitLengths(d_counts, 32, 15, d_lengths);
     PatchDistanceCodesForBuggyDecoders(d_lengths);
-    detect_tree_size = *outsize;
-    AddDynamicTree(ll_lengths, d_lengths, bp, out, outsize);
-    if (options->verbose) {
-      fprintf(stderr, "treesize: %d\n", (int)(*outsize - detect_tree_size));
-    }
+    EncodeTree(ll_lengths, d_lengths, &tree);
+    tree_size = TreeEncodingSize(&tree);
 
     /* Assert that for every present symbol, the code length is non-zero. */
     /* TODO(lode): remove this in release version. */
@@ -386,20 +533,39 @@ void AddLZ77Block(const Options* options, int btype, int final,
     for (i = 0; i < 32; i++) assert(d_counts[i] == 0 || d_lengths[i] > 0);
   }
 
+  /* The exact size is known up front, so the output is reserved only once. */
+  compressed_size = CalculateBlockSymbolSize(
+      ll_lengths, d_lengths, litlens, dists, lstart, lend);
+  InitBitWriter(3 + tree_size + compressed_size, options->arena,
+                bp, out, outsize, &w);
+
+  AddBits(final, 1, &w);
+  AddBits(btype & 1, 1, &w);
+  AddBits((btype & 2) >> 1, 1, &w);
+
+  if (btype == 2) {
+    AddTreeEncoding(&tree, &w);
+    if (options->verbose) {
+      fprintf(stderr, "treesize: %d\n", (int)(tree_size / 8));
+    }
+  }
+
   LengthsToSymbols(ll_lengths, 288, 15, ll_symbols);
   LengthsToSymbols(d_lengths, 32, 15, d_symbols);
+  ReverseSymbols(ll_lengths, 288, ll_symbols);
+  ReverseSymbols(d_lengths, 32, d_symbols);
 
-  detect_block_size = *outsize;
   AddLZ77Data(litlens, dists, lstart, lend, expected_data_size,
-              ll_symbols, ll_lengths, d_symbols, d_lengths,
-              bp, out, outsize);
+              ll_symbols, ll_lengths, d_symbols, d_lengths, &w);
   /* End symbol. */
-  AddHuffmanBits(ll_symbols[256], ll_lengths[256], bp, out, outsize);
+  AddBits(ll_symbols[256], ll_lengths[256], &w);
+  FlushBitWriter(&w);
+  FlushOutput(options, *bp, out, outsize);
 
   for (i = lstart; i < lend; i++) {
     uncompressed_size += dists[i] == 0 ? 1 : litlens[i];
   }
-  compressed_size = *outsize - detect_block_size;
+  compressed_size /= 8;
   if (options->verbose) {
     fprintf(stderr, "compressed block size: %d (%dk) (unc: %d)\n",
            (int)compressed_size, (int)(compressed_size / 1024),
@@ -415,16 +581,11 @@ void DeflateDynamicBlock(const Options* options, int final,
   size_t blocksize = inend - instart;
   LZ77Store store;
   int btype = 2;
+  ArenaMark mark = GetArenaMark(options->arena);
 
-  InitLZ77Store(&store);
+  InitLZ77Store(options->arena, &store);
 
-  s.options = options;
-  s.blockstart = instart;
-  s.blockend = inend;
-#ifdef USE_LONGEST_MATCH_CACHE
-  s.lmc = (LongestMatchCache*)malloc(sizeof(LongestMatchCache));
-  InitLongestMatchCache(blocksize, s.lmc);
-#endif
+  InitBlockState(options, instart, inend, 1, &s);
 
   LZ77Optimal(&s, in, instart, inend, &store);
 
@@ -433,17 +594,14 @@ void DeflateDynamicBlock(const Options* options, int final,
   if (store.size < 1000) {
     double dyncost, fixedcost;
     LZ77Store fixedstore;
-    InitLZ77Store(&fixedstore);
+    InitLZ77Store(options->arena, &fixedstore);
     LZ77OptimalFixed(&s, in, instart, inend, &fixedstore);
     dyncost = CalculateBlockSize(store.litlens, store.dists, 0, store.size, 2);
     fixedcost = CalculateBlockSize(fixedstore.litlens, fixedstore.dists,
         0, fixedstore.size, 1);
     if (fixedcost < dyncost) {
       btype = 1;
-      CleanLZ77Store(&store);
       store = fixedstore;
-    } else {
-      CleanLZ77Store(&fixedstore);
     }
   }
 
@@ -451,11 +609,8 @@ void DeflateDynamicBlock(const Options* options, int final,
                store.litlens, store.dists, 0, store.size,
                blocksize, bp, out, outsize);
 
-#ifdef USE_LONGEST_MATCH_CACHE
-  CleanLongestMatchCache(s.lmc);
-  free(s.lmc);
-#endif
-  CleanLZ77Store(&store);
+  CleanBlockState(&s);
+  ReleaseArena(options->arena, mark);
 }
 
 void DeflateFixedBlock(const Options* options, int final,
@@ -465,27 +620,19 @@ void DeflateFixedBlock(const Options* options, int final,
   BlockState s;
   size_t blocksize = inend - instart;
   LZ77Store store;
+  ArenaMark mark = GetArenaMark(options->arena);
 
-  InitLZ77Store(&store);
+  InitLZ77Store(options->arena, &store);
 
-  s.options = options;
-  s.blockstart = instart;
-  s.blockend = inend;
-#ifdef USE_LONGEST_MATCH_CACHE
-  s.lmc = (LongestMatchCache*)malloc(sizeof(LongestMatchCache));
-  InitLongestMatchCache(blocksize, s.lmc);
-#endif
+  InitBlockState(options, instart, inend, 1, &s);
 
   LZ77OptimalFixed(&s, in, instart, inend, &store);
 
   AddLZ77Block(s.options, 1, final, store.litlens, store.dists, 0, store.size,
                blocksize, bp, out, outsize);
 
-#ifdef USE_LONGEST_MATCH_CACHE
-  CleanLongestMatchCache(s.lmc);
-  free(s.lmc);
-#endif
-  CleanLZ77Store(&store);
+  CleanBlockState(&s);
+  ReleaseArena(options->arena, mark);
 }
 
 void DeflateNonCompressedBlock(const Options* options, int final,
@@ -493,29 +640,30 @@ void DeflateNonCompressedBlock(const Options* options, int final,
                                size_t inend,
                                unsigned char* bp,
                                unsigned char** out, size_t* outsize) {
-  size_t i;
   size_t blocksize = inend - instart;
   unsigned short nlen = ~blocksize;
+  BitWriter w;
 
-  (void)options;
   assert(blocksize < 65536);  /* Non compressed blocks are max this size. */
 
-  AddBit(final, bp, out, outsize);
+  InitBitWriter(3, options->arena, bp, out, outsize, &w);
+  AddBits(final, 1, &w);
   /* BTYPE 00 */
-  AddBit(0, bp, out, outsize);
-  AddBit(0, bp, out, outsize);
+  AddBits(0, 2, &w);
+  FlushBitWriter(&w);
 
   /* Any bits of input up to the next byte boundary are ignored. */
   *bp = 0;
 
-  APPEND_DATA(blocksize % 256, out, outsize);
-  APPEND_DATA((blocksize / 256) % 256, out, outsize);
-  APPEND_DATA(nlen % 256, out, outsize);
-  APPEND_DATA((nlen / 256) % 256, out, outsize);
+  ReserveOutput(4 + blocksize, options->arena, out, outsize);
+  (*out)[(*outsize)++] = blocksize % 256;
+  (*out)[(*outsize)++] = (blocksize / 256) % 256;
+  (*out)[(*outsize)++] = nlen % 256;
+  (*out)[(*outsize)++] = (nlen / 256) % 256;
 
-  for (i = instart; i < inend; i++) {
-    APPEND_DATA(in[i], out, outsize);
-  }
+  memcpy(*out + *outsize, in + instart, blocksize);
+  *outsize += blocksize;
+  FlushOutput(options, *bp, out, outsize);
 }
 
 void DeflateBlock(const Options* options,
@@ -533,6 +681,25 @@ void DeflateBlock(const Options* options,
   }
 }
 
+/*
+Moves the dynamic array of split points into the arena, so that it is not leaked
+when running out of memory while compressing the blocks. Returns the new array.
+The dynamic array is freed before the job is abandoned for lack of memory.
+*/
+static size_t* MoveSplitPointsToArena(Arena* arena,
+                                      size_t* splitpoints, size_t npoints) {
+  size_t* result;
+  if (npoints == 0) return splitpoints;
+  result = (size_t*)ArenaTryAllocate(arena, sizeof(*result) * npoints);
+  if (!result) {
+    free(splitpoints);
+    ArenaOutOfMemory(arena);
+  }
+  memcpy(result, splitpoints, sizeof(*result) * npoints);
+  free(splitpoints);
+  return result;
+}
+
 /*
 Does squeeze strategy where first block splitting is done, then each block is
 squeezed.
@@ -546,8 +713,10 @@ void DeflateSplittingFirst(const Options* options, int btype, int final,
   size_t i;
   size_t* splitpoints = 0;
   size_t npoints = 0;
+  ArenaMark mark = GetArenaMark(options->arena);
   if (btype == 0) {
-    BlockSplitSimple(in, instart, inend, 65535, &splitpoints, &npoints);
+    BlockSplitSimple(options->arena, in, instart, inend, 65535,
+                     &splitpoints, &npoints);
   } else if (btype == 1) {
     /* If all blocks are fixed tree, splitting into separate blocks only
     increases the total size. Leave npoints at 0, this represents 1 block. */
@@ -555,15 +724,18 @@ void DeflateSplittingFirst(const Options* options, int btype, int final,
     BlockSplit(options, in, instart, inend,
                options->blocksplittingmax, &splitpoints, &npoints);
   }
+  splitpoints = MoveSplitPointsToArena(options->arena, splitpoints, npoints);
 
   for (i = 0; i <= npoints; i++) {
     size_t start = i == 0 ? instart : splitpoints[i - 1];
     size_t end = i == npoints ? inend : splitpoints[i];
+    if (PollProgress(options)) break;
     DeflateBlock(options, btype, i == npoints && final, in, start, end,
                  bp, out, outsize);
+    ReportProgress(options, end);
   }
 
-  free(splitpoints);
+  ReleaseArena(options->arena, mark);
 }
 
 /*
@@ -581,6 +753,7 @@ void DeflateSplittingLast(const Options* options, int btype, int final,
   LZ77Store store;
   size_t* splitpoints = 0;
   size_t npoints = 0;
+  ArenaMark mark = GetArenaMark(options->arena);
 
   if (btype == 0) {
     /* This function only supports LZ77 compression. DeflateSplittingFirst
@@ -591,15 +764,9 @@ void DeflateSplittingLast(const Options* options, int btype, int final,
   }
   assert(btype == 1 || btype == 2);
 
-  InitLZ77Store(&store);
+  InitLZ77Store(options->arena, &store);
 
-  s.options = options;
-  s.blockstart = instart;
-  s.blockend = inend;
-#ifdef USE_LONGEST_MATCH_CACHE
-  s.lmc = (LongestMatchCache*)malloc(sizeof(LongestMatchCache));
-  InitLongestMatchCache(inend - instart, s.lmc);
-#endif
+  InitBlockState(options, instart, inend, 1, &s);
 
   if (btype == 2) {
     LZ77Optimal(&s, in, instart, inend, &store);
@@ -615,8 +782,9 @@ void DeflateSplittingLast(const Options* options, int btype, int final,
     BlockSplitLZ77(options, store.litlens, store.dists, store.size,
                    options->blocksplittingmax, &splitpoints, &npoints);
   }
+  splitpoints = MoveSplitPointsToArena(options->arena, splitpoints, npoints);
 
-  for (i = 0; i <= npoints; i++) {
+  for (i = 0; i <= npoints && !PollProgress(options); i++) {
     size_t start = i == 0 ? 0 : splitpoints[i - 1];
     size_t end = i == npoints ? store.size : splitpoints[i];
     AddLZ77Block(options, btype, i == npoints && final,
@@ -624,12 +792,8 @@ void DeflateSplittingLast(const Options* options, int btype, int final,
                  bp, out, outsize);
   }
 
-#ifdef USE_LONGEST_MATCH_CACHE
-  CleanLongestMatchCache(s.lmc);
-  free(s.lmc);
-#endif
-
-  CleanLZ77Store(&store);
+  CleanBlockState(&s);
+  ReleaseArena(options->arena, mark);
 }
 
 /*
@@ -644,6 +808,7 @@ static void DeflatePart(const Options* options, int btype, int final,
                         const unsigned char* in, size_t instart, size_t inend,
                         unsigned char* bp, unsigned char** out,
                         size_t* outsize) {
+  if (PollProgress(options)) return;
   if (options->blocksplitting) {
     if (options->blocksplittinglast) {
       DeflateSplittingLast(options, btype, final, in, instart, inend,
@@ -655,21 +820,92 @@ static void DeflatePart(const Options* options, int btype, int final,
   } else {
     DeflateBlock(options, btype, final, in, instart, inend, bp, out, outsize);
   }
+  ReportProgress(options, inend);
 }
 
-void Deflate(const Options* options, int btype, int final,
-             const unsigned char* in, size_t insize,
-             unsigned char* bp, unsigned char** out, size_t* outsize) {
-#if MASTER_BLOCK_SIZE == 0
-  DeflatePart(options, btype, final, in, 0, insize, bp, out, outsize);
-#else
+/* Deflates all master blocks of the input, see Options.masterblocksize. */
+static void DeflateMasterBlocks(const Options* options, int btype, int final,
+                                const unsigned char* in, size_t insize,
+                                unsigned char* bp, unsigned char** out,
+                                size_t* outsize) {
+  size_t blocksize = options->masterblocksize;
   size_t i = 0;
-  while (i < insize) {
-    int masterfinal = (i + MASTER_BLOCK_SIZE >= insize);
+
+  if (blocksize == 0) {
+    DeflatePart(options, btype, final, in, 0, insize, bp, out, outsize);
+    return;
+  }
+  while (i < insize && !PollProgress(options)) {
+    int masterfinal = (i + blocksize >= insize);
     int final2 = final && masterfinal;
-    size_t size = masterfinal ? insize - i : MASTER_BLOCK_SIZE;
+    size_t size = masterfinal ? insize - i : blocksize;
     DeflatePart(options, btype, final2, in, i, i + size, bp, out, outsize);
     i += size;
   }
-#endif
+}
+
+/*
+Runs DeflateMasterBlocks with the arena of the options. Returns 1 if the arena
+ran out of memory, 0 otherwise. The setjmp is done in a function of its own, so
+that no local variable is left indeterminate by the longjmp.
+*/
+static int DeflateWithArena(const Options* options, int btype, int final,
+                            const unsigned char* in, size_t insize,
+                            unsigned char* bp, unsigned char** out,
+                            size_t* outsize) {
+  jmp_buf failure;
+  options->arena->failure = &failure;
+  if (setjmp(failure)) return 1;
+  DeflateMasterBlocks(options, btype, final, in, insize, bp, out, outsize);
+  return 0;
+}
+
+int Deflate(const Options* options, int btype, int final,
+            const unsigned char* in, size_t insize,
+            unsigned char* bp, unsigned char** out, size_t* outsize) {
+  Options local = *options;
+  ProgressState progress;
+  RandomState random;
+  Arena arena;
+  jmp_buf* failure = 0;
+  int result;
+
+  /* The deadline, progress, random state and arena are shared by all blocks of
+  this call. */
+  if (options->filetimelimit > 0 && options->filedeadline <= 0) {
+    local.filedeadline = GetSeconds() + options->filetimelimit;
+  }
+  if (!options->progressstate) {
+    progress.insize = insize;
+    progress.done = 0;
+    progress.cancelled = 0;
+    local.progressstate = &progress;
+  }
+  if (!options->randomstate) {
+    InitRandomState(&random);
+    local.randomstate = &random;
+  }
+  if (options->arena) {
+    failure = options->arena->failure;
+  } else {
+    InitArena(options->allocator, 0, &arena);
+    local.arena = &arena;
+  }
+
+  result = DeflateWithArena(&local, btype, final, in, insize,
+                            bp, out, outsize);
+  if (result == 0 && local.progressstate->cancelled) {
+    result = 2;
+    if (options->stats) options->stats->stage = STAGE_CANCELLED;
+  }
+
+  if (options->stats && local.arena->peak > options->stats->peakmemory) {
+    options->stats->peakmemory = local.arena->peak;
+  }
+  if (options->arena) {
+    options->arena->failure = failure;
+  } else {
+    CleanArena(&arena);
+  }
+  return result;
 }
@@ -48,16 +48,31 @@ bp: bit pointer for the output array. This must initially be 0, and for
 out: pointer to the dynamic output array to which the result is appended. Must
   be freed after use.
 outsize: pointer to the dynamic output array size.
+returns 0 on success, 1 if the allocator of the options ran out of memory, or 2
+  if the progress or output function of the options cancelled the compression.
+  In both error cases out holds an incomplete result, which must still be
+  freed, and the final block may be missing.
 */
-void Deflate(const Options* options, int btype, int final,
+int Deflate(const Options* options, int btype, int final,
              const unsigned char* in, size_t insize,
              unsigned char* bp, unsigned char** out, size_t* outsize);
 
+/*
+Passes the finished bytes of the output array to Options.output, if set, and
+removes them from the array. If bp is not 0, the last byte is only partially
+filled, and is kept for the next block. Returns whether the output function
+asked to cancel.
+*/
+int FlushOutput(const Options* options, unsigned char bp,
+                unsigned char** out, size_t* outsize);
+
 /*
 Outputs the tree to a dynamic block (btype 10) according to the deflate
-specification.
+specification. Must be called within a Deflate call, out of memory abandons it
+through the arena of the options.
 */
-void AddDynamicTree(const unsigned* ll_lengths, const unsigned* d_lengths,
+void AddDynamicTree(const Options* options,
+                    const unsigned* ll_lengths, const unsigned* d_lengths,
                     unsigned char* bp, unsigned char** out, size_t* outsize);
 
 /*
@@ -73,43 +73,51 @@ unsigned long CRC(const unsigned char* buf, int len) {
 /*
 Compresses the data according to the gzip specification.
 */
-void GzipCompress(const Options* options,
+int GzipCompress(const Options* options,
                   const unsigned char* in, size_t insize,
                   unsigned char** out, size_t* outsize) {
   unsigned long crcvalue = CRC(in, insize);
   unsigned char bp = 0;
-
-  APPEND_DATA(31, out, outsize);  /* ID1 */
-  APPEND_DATA(139, out, outsize);  /* ID2 */
-  APPEND_DATA(8, out, outsize);  /* CM */
-  APPEND_DATA(0, out, outsize);  /* FLG */
-  /* MTIME */
-  APPEND_DATA(0, out, outsize);
-  APPEND_DATA(0, out, outsize);
-  APPEND_DATA(0, out, outsize);
-  APPEND_DATA(0, out, outsize);
-
-  APPEND_DATA(2, out, outsize);  /* XFL, 2 indicates best compression. */
-  APPEND_DATA(3, out, outsize);  /* OS follows Unix conventions. */
-
-  Deflate(options, 2 /* Dynamic block */, 1, in, insize, &bp, out, outsize);
+  static const unsigned char header[10] = {
+    31,  /* ID1 */
+    139,  /* ID2 */
+    8,  /* CM */
+    0,  /* FLG */
+    0, 0, 0, 0,  /* MTIME */
+    2,  /* XFL, 2 indicates best compression. */
+    3  /* OS follows Unix conventions. */
+  };
+  unsigned char trailer[8];
+  int error;
+
+  if (AppendBytes(header, sizeof(header), out, outsize)) return 1;
+
+  error = Deflate(options, 2 /* Dynamic block */, 1,
+                  in, insize, &bp, out, outsize);
+  if (error) return error;
 
   /* CRC */
-  APPEND_DATA(crcvalue % 256, out, outsize);
-  APPEND_DATA((crcvalue >> 8) % 256, out, outsize);
-  APPEND_DATA((crcvalue >> 16) % 256, out, outsize);
-  APPEND_DATA((crcvalue >> 24) % 256, out, outsize);
+  trailer[0] = crcvalue % 256;
+  trailer[1] = (crcvalue >> 8) % 256;
+  trailer[2] = (crcvalue >> 16) % 256;
+  trailer[3] = (crcvalue >> 24) % 256;
 
   /* ISIZE */
-  APPEND_DATA(insize % 256, out, outsize);
-  APPEND_DATA((insize >> 8) % 256, out, outsize);
-  APPEND_DATA((insize >> 16) % 256, out, outsize);
-  APPEND_DATA((insize >> 24) % 256, out, outsize);
+  trailer[4] = insize % 256;
+  trailer[5] = (insize >> 8) % 256;
+  trailer[6] = (insize >> 16) % 256;
+  trailer[7] = (insize >> 24) % 256;
+  if (AppendBytes(trailer, sizeof(trailer), out, outsize)) return 1;
+  if (FlushOutput(options, 0, out, outsize)) {
+    if (options->stats) options->stats->stage = STAGE_CANCELLED;
+    return 2;
+  }
 
-  if (options->verbose) {
+  if (options->verbose && !options->output) {
     fprintf(stderr,
             "Original Size: %d, Compressed: %d, Compression: %f%% Removed\n",
             (int)insize, (int)*outsize,
             100.0f * (float)(insize - *outsize) / (float)insize);
   }
+  return 0;
 }
@@ -22,61 +22,94 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define HASH_SHIFT 5
-#define HASH_MASK 32767
+#define HASH_MASK (HASH_SIZE - 1)
 
-void InitHash(size_t window_size, Hash* h) {
+/* Multiplier of the hash of Options.hash4 (2^32 divided by the golden ratio),
+and the amount of bits of the product it keeps. */
+#define HASH4_MULTIPLIER 2654435761UL
+#define HASH4_BITS 15
+
+/* Empty child or root in the binary tree. */
+#define TREE_NONE ((size_t)(-1))
+
+void InitHash(size_t window_size, const Options* options, Hash* h) {
+  Arena* arena = options->arena;
   size_t i;
 
   h->val = 0;
-  h->head = (int*)malloc(sizeof(*h->head) * 65536);
-  h->prev = (unsigned short*)malloc(sizeof(*h->prev) * window_size);
-  h->hashval = (int*)malloc(sizeof(*h->hashval) * window_size);
-  for (i = 0; i < 65536; i++) {
-    h->head[i] = -1;  /* -1 indicates no head so far. */
-  }
-  for (i = 0; i < window_size; i++) {
-    h->prev[i] = i;  /* If prev[j] == j, then prev[j] is uninitialized. */
-    h->hashval[i] = -1;
+  h->hash4 = options->hash4;
+  h->tree = 0;
+  h->treesteps = 0;
+  if (options->binarytree) {
+    h->tree = (size_t*)ArenaAllocate(arena,
+        sizeof(*h->tree) * 2 * window_size);
+    h->treehead = (size_t*)ArenaAllocate(arena,
+        sizeof(*h->treehead) * (HASH_MASK + 1));
+    h->treesublen = (unsigned short*)ArenaAllocate(arena,
+        sizeof(*h->treesublen) * 259);
+    for (i = 0; i <= HASH_MASK; i++) {
+      h->treehead[i] = TREE_NONE;
+    }
+    h->treenext = 0;
+    h->treedepth = options->chainhits;
+    h->treepos = TREE_NONE;
+    h->treelength = 0;
   }
 
 #ifdef USE_HASH_SAME
-  h->same = (unsigned short*)malloc(sizeof(*h->same) * window_size);
+  h->same = (unsigned short*)ArenaAllocate(arena,
+      sizeof(*h->same) * window_size);
   for (i = 0; i < window_size; i++) {
     h->same[i] = 0;
   }
 #endif
 
-#ifdef USE_HASH_SAME_HASH
+  if (h->tree) return;
+
+  h->head = (unsigned short*)ArenaAllocate(arena,
+      sizeof(*h->head) * HASH_SIZE);
+  h->prev = (unsigned short*)ArenaAllocate(arena,
+      sizeof(*h->prev) * window_size);
+  h->hashval = (unsigned short*)ArenaAllocate(arena,
+      sizeof(*h->hashval) * window_size);
+  for (i = 0; i < HASH_SIZE; i++) {
+    h->head[i] = HASH_NONE;
+  }
+  for (i = 0; i < window_size; i++) {
+    h->prev[i] = i;  /* If prev[j] == j, then prev[j] is uninitialized. */
+    h->hashval[i] = HASH_NONE;
+  }
+
+#ifdef USE_HASH_SAME
   h->val2 = 0;
-  h->head2 = (int*)malloc(sizeof(*h->head2) * 65536);
-  h->prev2 = (unsigned short*)malloc(sizeof(*h->prev2) * window_size);
-  h->hashval2 = (int*)malloc(sizeof(*h->hashval2) * window_size);
-  for (i = 0; i < 65536; i++) {
-    h->head2[i] = -1;
+  h->head2 = (unsigned short*)ArenaAllocate(arena,
+      sizeof(*h->head2) * HASH_SIZE);
+  h->prev2 = (unsigned short*)ArenaAllocate(arena,
+      sizeof(*h->prev2) * window_size);
+  h->hashval2 = (unsigned short*)ArenaAllocate(arena,
+      sizeof(*h->hashval2) * window_size);
+  for (i = 0; i < HASH_SIZE; i++) {
+    h->head2[i] = HASH_NONE;
   }
   for (i = 0; i < window_size; i++) {
     h->prev2[i] = i;
-    h->hashval2[i] = -1;
+    h->hashval2[i] = HASH_NONE;
   }
 #endif
 }
 
-void CleanHash(Hash* h) {
-  free(h->head);
-  free(h->prev);
-  free(h->hashval);
-
-#ifdef USE_HASH_SAME_HASH
-  free(h->head2);
-  free(h->prev2);
-  free(h->hashval2);
-#endif
-
-#ifdef USE_HASH_SAME
-  free(h->same);
-#endif
+/* Links index hpos into the chain of hash value val of the given arrays. */
+static void LinkHash(unsigned short hpos, int val, unsigned short* head,
+                     unsigned short* prev, unsigned short* hashval) {
+  hashval[hpos] = val;
+  if (head[val] != HASH_NONE && hashval[head[val]] == val) {
+    prev[hpos] = head[val];
+  }
+  else prev[hpos] = hpos;
+  head[val] = hpos;
 }
 
 /*
@@ -88,19 +121,42 @@ static void UpdateHashValue(Hash* h, unsigned char c) {
   h->val = (((h->val) << HASH_SHIFT) ^ (c)) & HASH_MASK;
 }
 
-void UpdateHash(const unsigned char* array, size_t pos, size_t end, Hash* h) {
+/*
+The hash value for Options.hash4: the 4 bytes at pos times a large odd
+constant, of which the top bits mix in all bytes. Bytes at end or after it
+count as 0.
+*/
+static int Hash4Value(const unsigned char* array, size_t pos, size_t end) {
+  unsigned long v;
+  if (pos + 4 <= end) {
+    v = ((unsigned long)array[pos] << 24)
+        | ((unsigned long)array[pos + 1] << 16)
+        | ((unsigned long)array[pos + 2] << 8) | array[pos + 3];
+  } else {
+    size_t i;
+    v = 0;
+    for (i = pos; i < pos + 4; i++) v = (v << 8) | (i < end ? array[i] : 0);
+  }
+  return (int)(((v * HASH4_MULTIPLIER) & 0xffffffffUL) >> (32 - HASH4_BITS));
+}
+
+/*
+UpdateHash, see there. If link is 0, pos is left out of the hash chains when
+the MAX_MATCH + 1 bytes from pos on are all the same, see UpdateHashRange.
+*/
+static void UpdateHashAt(const unsigned char* array, size_t pos, size_t end,
+                         int link, Hash* h) {
   unsigned short hpos = pos & WINDOW_MASK;
 #ifdef USE_HASH_SAME
   size_t amount = 0;
 #endif
 
-  UpdateHashValue(h, pos + MIN_MATCH <= end ? array[pos + MIN_MATCH - 1] : 0);
-  h->hashval[hpos] = h->val;
-  if (h->head[h->val] != -1 && h->hashval[h->head[h->val]] == h->val) {
-    h->prev[hpos] = h->head[h->val];
+  if (h->hash4) {
+    h->val = Hash4Value(array, pos, end);
+  } else {
+    UpdateHashValue(h,
+        pos + MIN_MATCH <= end ? array[pos + MIN_MATCH - 1] : 0);
   }
-  else h->prev[hpos] = hpos;
-  h->head[h->val] = hpos;
 
 #ifdef USE_HASH_SAME
   /* Update "same". */
@@ -112,21 +168,197 @@ void UpdateHash(const unsigned char* array, size_t pos, size_t end, Hash* h) {
     amount++;
   }
   h->same[hpos] = amount;
-#endif
-
-#ifdef USE_HASH_SAME_HASH
   h->val2 = ((h->same[hpos] - MIN_MATCH) & 255) ^ h->val;
-  h->hashval2[hpos] = h->val2;
-  if (h->head2[h->val2] != -1 && h->hashval2[h->head2[h->val2]] == h->val2) {
-    h->prev2[hpos] = h->head2[h->val2];
+  if (amount >= MAX_MATCH && !link) {
+    /* What was at this index before is out of the window now, so no chain
+    may be linked to it anymore. */
+    if (!h->tree) h->hashval[hpos] = h->hashval2[hpos] = HASH_NONE;
+    return;
   }
-  else h->prev2[hpos] = hpos;
-  h->head2[h->val2] = hpos;
+#else
+  (void)link;
+#endif
+
+  if (h->tree) return;
+  LinkHash(hpos, h->val, h->head, h->prev, h->hashval);
+#ifdef USE_HASH_SAME
+  LinkHash(hpos, h->val2, h->head2, h->prev2, h->hashval2);
 #endif
 }
 
+void UpdateHash(const unsigned char* array, size_t pos, size_t end, Hash* h) {
+  UpdateHashAt(array, pos, end, 1, h);
+}
+
+void UpdateHashRange(const unsigned char* array, size_t pos, size_t length,
+                     size_t end, Hash* h) {
+  size_t i = pos;
+  while (i < pos + length) {
+#ifdef USE_HASH_SAME
+    size_t same = h->same[(i - 1) & WINDOW_MASK];
+    if (i + 1 < pos + length && same > MAX_MATCH) {
+      /* A stretch of positions that are not linked: all there is to do is
+      setting their same values, and clearing their hash values as
+      UpdateHashAt does. The hash value after them is that of their byte
+      repeated. */
+      size_t stop = pos + length - 1;  /* The last position is linked. */
+      while (i < stop && same > MAX_MATCH) {
+        size_t n = 0;
+        int down = 1;
+        if (same == (unsigned short)(-1) && i + same < end) {
+          /* A count cut off at its maximum stays there while the run goes on
+          after it. Usually it goes on through the whole range. */
+          const unsigned char* ahead = &array[i + same];
+          size_t max = end - i - same < stop - i ? end - i - same : stop - i;
+          if (ahead[0] == array[i] && memcmp(ahead, ahead + 1, max - 1) == 0) {
+            n = max;
+          } else {
+            while (n < max && ahead[n] == array[i]) n++;
+          }
+          down = n == 0;
+        }
+        if (down) {
+          /* Otherwise it counts down. */
+          n = same - MAX_MATCH < stop - i ? same - MAX_MATCH : stop - i;
+        }
+        while (n > 0) {
+          size_t hpos = i & WINDOW_MASK;
+          size_t part = WINDOW_SIZE - hpos < n ? WINDOW_SIZE - hpos : n;
+          size_t k;
+          if (down) {
+            for (k = 0; k < part; k++) h->same[hpos + k] = same - 1 - k;
+            same -= part;
+          } else {
+            for (k = 0; k < part; k++) h->same[hpos + k] = same;
+          }
+          if (!h->tree) {
+            /* Sets every value to HASH_NONE. */
+            memset(&h->hashval[hpos], 255, sizeof(*h->hashval) * part);
+            memset(&h->hashval2[hpos], 255, sizeof(*h->hashval2) * part);
+          }
+          i += part;
+          n -= part;
+        }
+      }
+      if (h->hash4) {
+        h->val = Hash4Value(array, i - 1, end);
+      } else {
+        UpdateHashValue(h, array[i - 1]);
+        UpdateHashValue(h, array[i - 1]);
+        UpdateHashValue(h, array[i - 1]);
+      }
+      continue;
+    }
+#endif
+    UpdateHashAt(array, i, end, i + 1 == pos + length, h);
+    i++;
+  }
+}
+
 void WarmupHash(const unsigned char* array, size_t pos, size_t end, Hash* h) {
   (void)end;
   UpdateHashValue(h, array[pos + 0]);
   UpdateHashValue(h, array[pos + 1]);
+  h->treenext = pos;
+}
+
+/*
+Returns the length of the match of scan and match, given that their first
+length bytes are known to be equal, up to limit.
+*/
+static size_t TreeMatchLength(const unsigned char* scan,
+                              const unsigned char* match,
+                              size_t length, size_t limit) {
+  while (length + sizeof(size_t) <= limit
+      && *((size_t*)(scan + length)) == *((size_t*)(match + length))) {
+    length += sizeof(size_t);
+  }
+  while (length < limit && scan[length] == match[length]) length++;
+  return length;
+}
+
+/*
+Adds pos to the binary tree and finds its matches on the way: the strings
+closest to it in sort order are on the path from the root, and for each length
+the nearest match of at least that length is met before any further one.
+*/
+static void AddToTree(const unsigned char* array, size_t pos, size_t end,
+                      Hash* h) {
+  /* Where the next node that sorts before or after pos will be linked. */
+  size_t* before = &h->tree[2 * (pos & WINDOW_MASK)];
+  size_t* after = before + 1;
+  /* Known common length of pos with all nodes that are still left in the
+  subtree, on both sides. */
+  size_t beforelength = 0;
+  size_t afterlength = 0;
+  size_t limit = end - pos < MAX_MATCH ? end - pos : MAX_MATCH;
+  size_t bestlength = 1;
+  size_t hval, candidate;
+  int depth = h->treedepth;
+
+  h->treepos = pos;
+  h->treelength = 0;
+  if (limit < MIN_MATCH) {
+    /* Nothing to match. Later positions are shorter still, so pos is not
+    linked into the tree either. */
+    *before = *after = TREE_NONE;
+    return;
+  }
+
+  hval = ((array[pos] << (2 * HASH_SHIFT)) ^ (array[pos + 1] << HASH_SHIFT)
+      ^ array[pos + 2]) & HASH_MASK;
+  candidate = h->treehead[hval];
+  h->treehead[hval] = pos;
+
+  for (;;) {
+    size_t* children;
+    size_t length;
+
+    if (candidate == TREE_NONE || pos - candidate >= WINDOW_SIZE
+        || depth-- <= 0) {
+      *before = *after = TREE_NONE;
+      break;
+    }
+    h->treesteps++;
+
+    children = &h->tree[2 * (candidate & WINDOW_MASK)];
+    length = TreeMatchLength(&array[pos], &array[candidate],
+        beforelength < afterlength ? beforelength : afterlength, limit);
+    if (length > bestlength) {
+      size_t j;
+      for (j = bestlength + 1; j <= length; j++) {
+        h->treesublen[j] = pos - candidate;
+      }
+      bestlength = length;
+    }
+
+    if (length == limit) {
+      /* The candidate can not be told apart from pos any further, pos takes
+      its place in the tree. */
+      *before = children[0];
+      *after = children[1];
+      break;
+    }
+
+    if (array[candidate + length] < array[pos + length]) {
+      *before = candidate;
+      before = &children[1];
+      candidate = *before;
+      beforelength = length;
+    } else {
+      *after = candidate;
+      after = &children[0];
+      candidate = *after;
+      afterlength = length;
+    }
+  }
+
+  h->treelength = bestlength;
+}
+
+void UpdateTree(const unsigned char* array, size_t pos, size_t end, Hash* h) {
+  assert(h->tree);
+  for (; h->treenext <= pos; h->treenext++) {
+    AddToTree(array, h->treenext, end, h);
+  }
 }
@@ -24,33 +24,68 @@ The hash for FindLongestMatch of lz77.c.
 #ifndef ZOPFLI_HASH_H_
 #define ZOPFLI_HASH_H_
 
+#include "arena.h"
 #include "util.h"
 
+/* Amount of hash values. */
+#define HASH_SIZE 32768
+
+/* Value of head and hashval for none so far. */
+#define HASH_NONE 65535
+
+/*
+The arrays are all of unsigned short, since both window indices and hash values
+fit in 16 bits. That keeps them small enough to stay in the cache, which matters
+most for prev: besides assertions, a step along a hash chain only reads prev,
+and hashval2 until it switches to the second hash.
+*/
 typedef struct Hash {
-  int* head;  /* Hash value to index of its most recent occurance. */
+  /* Hash value to index of its most recent occurance. */
+  unsigned short* head;
   unsigned short* prev;  /* Index to index of prev. occurance of same hash. */
-  int* hashval;  /* Index to hash value at this index. */
+  unsigned short* hashval;  /* Index to hash value at this index. */
   int val;  /* Current hash value. */
+  int hash4;  /* Options.hash4. */
 
-#ifdef USE_HASH_SAME_HASH
+#ifdef USE_HASH_SAME
   /* Fields with similar purpose as the above hash, but for the second hash with
-  a value that is calculated differently.  */
-  int* head2;  /* Hash value to index of its most recent occurance. */
+  a value that is calculated differently, see Options.samehash.  */
+  /* Hash value to index of its most recent occurance. */
+  unsigned short* head2;
   unsigned short* prev2;  /* Index to index of prev. occurance of same hash. */
-  int* hashval2;  /* Index to hash value at this index. */
+  unsigned short* hashval2;  /* Index to hash value at this index. */
   int val2;  /* Current hash value. */
 #endif
 
 #ifdef USE_HASH_SAME
   unsigned short* same;  /* Amount of repetitions of same byte after this .*/
 #endif
-} Hash;
 
-/* Allocates and initializes all fields of Hash. */
-void InitHash(size_t window_size, Hash* h);
+  /*
+  Binary tree of the window for Options.binarytree, or null if the hash chains
+  above are used instead. In that case head, prev and hashval and the second
+  hash are not used. Each window index holds the positions of its two children:
+  strings that sort before it on the left, strings that sort after it on the
+  right. Every added position becomes the root of the tree of its hash value,
+  so the children of a node are always older than the node itself.
+  */
+  size_t* tree;
+  size_t* treehead;  /* Hash value to the position at the root of its tree. */
+  size_t treenext;  /* The next position to add to the tree. */
+  int treedepth;  /* Maximum amount of nodes visited when adding a position. */
+  /* Matches of the position added last, as FindLongestMatch gives them for
+  limit MAX_MATCH. */
+  size_t treepos;
+  unsigned short treelength;
+  unsigned short* treesublen;  /* 259 elements. */
+  double treesteps;  /* Nodes visited so far. */
+} Hash;
 
-/* Frees all fields of Hash. */
-void CleanHash(Hash* h);
+/*
+Allocates and initializes all fields of Hash for the match finder chosen by the
+options. The memory belongs to the arena of the options.
+*/
+void InitHash(size_t window_size, const Options* options, Hash* h);
 
 /*
 Updates the hash values based on the current position in the array. All calls
@@ -58,6 +93,19 @@ to this must be made for consecutive bytes.
 */
 void UpdateHash(const unsigned char* array, size_t pos, size_t end, Hash* h);
 
+/*
+UpdateHash for the length positions from pos on, none of which FindLongestMatch
+will be asked about except maybe the last one, such as the rest of a match.
+Inside a run of the same byte, every position with more than MAX_MATCH more of
+it after it starts with the same MAX_MATCH bytes as the position after it. So
+those are left out of the hash chains, except for the last position of the
+range: for any later position, a nearer one with the same match is linked. The
+hash chains then do not grow through long runs, and the matches found stay the
+same. Only available with USE_HASH_SAME, otherwise all positions are linked.
+*/
+void UpdateHashRange(const unsigned char* array, size_t pos, size_t length,
+                     size_t end, Hash* h);
+
 /*
 Prepopulates hash:
 Fills in the initial values in the hash, before UpdateHash can be used
@@ -65,4 +113,13 @@ correctly.
 */
 void WarmupHash(const unsigned char* array, size_t pos, size_t end, Hash* h);
 
+/*
+Adds all positions that UpdateHash went over, up to and including pos, to the
+binary tree, and sets treepos, treelength and treesublen to the matches of pos.
+Adding a position finds its matches anyway, so the tree is only brought up to
+date when a match is asked for that the longest match cache does not have.
+end: end of the data, matches do not go past it.
+*/
+void UpdateTree(const unsigned char* array, size_t pos, size_t end, Hash* h);
+
 #endif  /* ZOPFLI_HASH_H_ */
@@ -27,6 +27,13 @@ Jyrki Katajainen, Alistair Moffat, Andrew Turpin".
 #include <assert.h>
 #include <stdlib.h>
 
+/*
+Largest alphabet and bit length limit supported, those of deflate. All memory
+is taken from the stack with these sizes, so no allocation can fail.
+*/
+#define MAX_SYMBOLS 288
+#define MAX_BITS 15
+
 typedef struct Node Node;
 
 /*
@@ -186,10 +193,14 @@ int LengthLimitedCodeLengths(
 
   /* Array of lists of chains. Each list requires only two lookahead chains at
   a time, so each list is a array of two Node*'s. */
-  Node* (*lists)[2];
+  Node* lists[MAX_BITS][2];
 
   /* One leaf per symbol. Only numsymbols leaves will be used. */
-  Node* leaves = (Node*)malloc(n * sizeof(*leaves));
+  Node leaves[MAX_SYMBOLS];
+
+  Node nodes[2 * MAX_BITS * (MAX_BITS + 1)];
+
+  if (n > MAX_SYMBOLS || maxbits > MAX_BITS) return 1;
 
   /* Initialize all bitlengths at 0. */
   for (i = 0; i < n; i++) {
@@ -207,16 +218,13 @@ int LengthLimitedCodeLengths(
 
   /* Check special cases and error conditions. */
   if ((1 << maxbits) < numsymbols) {
-    free(leaves);
     return 1;  /* Error, too few maxbits to represent symbols. */
   }
   if (numsymbols == 0) {
-    free(leaves);
     return 0;  /* No symbols at all. OK. */
   }
   if (numsymbols == 1) {
     bitlengths[leaves[0].count] = 1;
-    free(leaves);
     return 0;  /* Only one symbol, give it bitlength 1, not 0. OK. */
   }
 
@@ -225,13 +233,12 @@ int LengthLimitedCodeLengths(
 
   /* Initialize node memory pool. */
   pool.size = 2 * maxbits * (maxbits + 1);
-  pool.nodes = (Node*)malloc(pool.size * sizeof(*pool.nodes));
+  pool.nodes = nodes;
   pool.next = pool.nodes;
   for (i = 0; i < pool.size; i++) {
     pool.nodes[i].inuse = 0;
   }
 
-  lists = (Node* (*)[2])malloc(maxbits * sizeof(*lists));
   InitLists(&pool, leaves, maxbits, lists);
 
   /* In the last list, 2 * numsymbols - 2 active chains need to be created. Two
@@ -244,8 +251,5 @@ int LengthLimitedCodeLengths(
 
   ExtractBitLengths(lists[maxbits - 1][1], leaves, bitlengths);
 
-  free(lists);
-  free(leaves);
-  free(pool.nodes);
   return 0;  /* OK. */
 }
@@ -31,8 +31,8 @@ of 0, and if only a single symbol occurs at least once, its bitlength will be 1,
 and not 0 as would theoretically be needed for a single symbol.
 
 frequencies: The amount of occurances of each symbol.
-n: The amount of symbols.
-maxbits: Maximum bit length, inclusive.
+n: The amount of symbols, at most 288.
+maxbits: Maximum bit length, inclusive, at most 15.
 bitlengths: Output, the bitlengths for the symbol prefix codes.
 return: 0 for OK, non-0 for error.
 */
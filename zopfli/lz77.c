@@ -23,31 +23,50 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include <stdio.h>
 #include <stdlib.h>
 
-void InitLZ77Store(LZ77Store* store) {
+void InitLZ77Store(Arena* arena, LZ77Store* store) {
   store->size = 0;
+  store->capacity = 0;
   store->litlens = 0;
   store->dists = 0;
+  store->arena = arena;
 }
 
-void CleanLZ77Store(LZ77Store* store) {
-  free(store->litlens);
-  free(store->dists);
+void ReserveLZ77Store(size_t capacity, LZ77Store* store) {
+  unsigned short* data;
+  if (capacity <= store->capacity) return;
+
+  /* The old values stay in the arena until it is released, stores are normally
+  reserved up front so this rarely happens. */
+  data = (unsigned short*)ArenaAllocate(store->arena,
+                                        sizeof(*data) * capacity * 2);
+  if (store->size > 0) {
+    memcpy(data, store->litlens, sizeof(*data) * store->size);
+    memcpy(data + capacity, store->dists, sizeof(*data) * store->size);
+  }
+  store->litlens = data;
+  store->dists = data + capacity;
+  store->capacity = capacity;
 }
 
-void CopyLZ77Store(
-    const LZ77Store* source, LZ77Store* dest) {
-  size_t i;
-  CleanLZ77Store(dest);
-  dest->litlens =
-      (unsigned short*)malloc(sizeof(*dest->litlens) * source->size);
-  dest->dists = (unsigned short*)malloc(sizeof(*dest->dists) * source->size);
+void ClearLZ77Store(LZ77Store* store) {
+  store->size = 0;
+}
 
-  if (!dest->litlens || !dest->dists) exit(-1); /* Allocation failed. */
+void SwapLZ77Store(LZ77Store* a, LZ77Store* b) {
+  LZ77Store temp = *a;
+  *a = *b;
+  *b = temp;
+}
 
+void CopyLZ77Store(
+    const LZ77Store* source, LZ77Store* dest) {
+  ClearLZ77Store(dest);
+  ReserveLZ77Store(source->size, dest);
   dest->size = source->size;
-  for (i = 0; i < source->size; i++) {
-    dest->litlens[i] = source->litlens[i];
-    dest->dists[i] = source->dists[i];
+  if (source->size > 0) {
+    memcpy(dest->litlens, source->litlens,
+           sizeof(*dest->litlens) * source->size);
+    memcpy(dest->dists, source->dists, sizeof(*dest->dists) * source->size);
   }
 }
 
@@ -57,9 +76,12 @@ context must be a LZ77Store*.
 */
 void StoreLitLenDist(unsigned short length, unsigned short dist,
                      LZ77Store* store) {
-  size_t size2 = store->size;  /* Needed for using APPEND_DATA twice. */
-  APPEND_DATA(length, &store->litlens, &store->size);
-  APPEND_DATA(dist, &store->dists, &size2);
+  if (store->size == store->capacity) {
+    ReserveLZ77Store(store->capacity == 0 ? 1 : store->capacity * 2, store);
+  }
+  store->litlens[store->size] = length;
+  store->dists[store->size] = dist;
+  store->size++;
 }
 
 /*
@@ -149,12 +171,18 @@ int TryGetFromLongestMatchCache(BlockState* s, size_t pos, size_t* limit,
   /* The LMC cache starts at the beginning of the block rather than the
      beginning of the whole array. */
   size_t lmcpos = pos - s->blockstart;
+  unsigned char cache_available;
+  unsigned char limit_ok_for_cache;
+
+  if (!s->lmc) return 0;
+  s->lmc->lookups++;
+  /* A cache with a memory limit may cover only the start of the block. */
+  if (lmcpos >= s->lmc->positions) return 0;
 
   /* Length > 0 and dist 0 is invalid combination, which indicates on purpose
      that this cache value is not filled in yet. */
-  unsigned char cache_available = s->lmc && (s->lmc->length[lmcpos] == 0 ||
-      s->lmc->dist[lmcpos] != 0);
-  unsigned char limit_ok_for_cache = cache_available && (*limit == MAX_MATCH ||
+  cache_available = s->lmc->length[lmcpos] == 0 || s->lmc->dist[lmcpos] != 0;
+  limit_ok_for_cache = cache_available && (*limit == MAX_MATCH ||
       s->lmc->length[lmcpos] <= *limit ||
       (sublen && MaxCachedSublen(s->lmc,
           lmcpos, s->lmc->length[lmcpos]) >= *limit));
@@ -173,6 +201,7 @@ int TryGetFromLongestMatchCache(BlockState* s, size_t pos, size_t* limit,
       } else {
         *distance = s->lmc->dist[lmcpos];
       }
+      s->lmc->hits++;
       return 1;
     }
     /* Can't use much of the cache, since the "sublens" need to be calculated,
@@ -193,13 +222,15 @@ void StoreInLongestMatchCache(BlockState* s, size_t pos, size_t limit,
   /* The LMC cache starts at the beginning of the block rather than the
      beginning of the whole array. */
   size_t lmcpos = pos - s->blockstart;
+  unsigned char cache_available;
+
+  if (!s->lmc || lmcpos >= s->lmc->positions) return;
 
   /* Length > 0 and dist 0 is invalid combination, which indicates on purpose
      that this cache value is not filled in yet. */
-  unsigned char cache_available = s->lmc && (s->lmc->length[lmcpos] == 0 ||
-      s->lmc->dist[lmcpos] != 0);
+  cache_available = s->lmc->length[lmcpos] == 0 || s->lmc->dist[lmcpos] != 0;
 
-  if (s->lmc && limit == MAX_MATCH && sublen && !cache_available) {
+  if (limit == MAX_MATCH && sublen && !cache_available) {
     assert(s->lmc->length[lmcpos] == 1 && s->lmc->dist[lmcpos] == 0);
     s->lmc->dist[lmcpos] = length < MIN_MATCH ? 0 : distance;
     s->lmc->length[lmcpos] = length < MIN_MATCH ? 0 : length;
@@ -209,9 +240,16 @@ void StoreInLongestMatchCache(BlockState* s, size_t pos, size_t limit,
 }
 #endif
 
-void FindLongestMatch(BlockState* s, const Hash* h, const unsigned char* array,
-    size_t pos, size_t size, size_t limit,
-    unsigned short* sublen, unsigned short* distance, unsigned short* length) {
+/*
+The match finder, see FindLongestMatchFun. samehash: Options.samehash. hints:
+whether to try the distances of the block state first, see Options.rowstride.
+This is only called with constant switches, so each caller gets a copy without
+the tests in the loop over the hash chain.
+*/
+static FORCE_INLINE void FindLongestMatchKernel(BlockState* s, Hash* h,
+    const unsigned char* array, size_t pos, size_t size, size_t limit,
+    unsigned short* sublen, unsigned short* distance, unsigned short* length,
+    int samehash, int hints) {
   unsigned short hpos = pos & WINDOW_MASK, p, pp;
   unsigned short bestdist = 0;
   unsigned short bestlength = 1;
@@ -219,15 +257,13 @@ void FindLongestMatch(BlockState* s, const Hash* h, const unsigned char* array,
   const unsigned char* match;
   const unsigned char* arrayend;
   const unsigned char* arrayend_safe;
-#if MAX_CHAIN_HITS < WINDOW_SIZE
-  int chain_counter = MAX_CHAIN_HITS;  /* For quitting early. */
-#endif
+  int chain_counter = s->options->chainhits;  /* For quitting early. */
 
   unsigned dist = 0;  /* Not unsigned short on purpose. */
 
-  int* hhead = h->head;
+  unsigned short* hhead = h->head;
   unsigned short* hprev = h->prev;
-  int* hhashval = h->hashval;
+  unsigned short* hhashval = h->hashval;
   int hval = h->val;
 
 #ifdef USE_LONGEST_MATCH_CACHE
@@ -255,7 +291,36 @@ void FindLongestMatch(BlockState* s, const Hash* h, const unsigned char* array,
   arrayend = &array[pos] + limit;
   arrayend_safe = arrayend - 8;
 
-  assert(hval < 65536);
+  if (hints) {
+    /* Seed the best match with the distances of the image layout. The chain
+    walk below then skips everything that is not longer. */
+    int k;
+    for (k = 0; k < s->numhintdists && bestlength < limit; k++) {
+      unsigned short currentlength;
+      dist = s->hintdists[k];
+      if (dist > pos) break;
+      scan = &array[pos];
+      match = &array[pos - dist];
+      if (pos + bestlength < size
+          && *(scan + bestlength) != *(match + bestlength)) {
+        continue;
+      }
+      scan = GetMatch(scan, match, arrayend, arrayend_safe);
+      currentlength = scan - &array[pos];
+      if (currentlength > bestlength) {
+        if (sublen) {
+          unsigned short j;
+          for (j = bestlength + 1; j <= currentlength; j++) {
+            sublen[j] = dist;
+          }
+        }
+        bestdist = dist;
+        bestlength = currentlength;
+      }
+    }
+  }
+
+  assert(hval < HASH_SIZE);
 
   pp = hhead[hval];  /* During the whole loop, p == hprev[pp]. */
   p = hprev[pp];
@@ -265,7 +330,7 @@ void FindLongestMatch(BlockState* s, const Hash* h, const unsigned char* array,
   dist = p < pp ? pp - p : ((WINDOW_SIZE - p) + pp);
 
   /* Go through all distances. */
-  while (dist < WINDOW_SIZE) {
+  while (dist < WINDOW_SIZE && (!hints || bestlength < limit)) {
     unsigned short currentlength = 0;
 
     assert(p < WINDOW_SIZE);
@@ -310,9 +375,9 @@ void FindLongestMatch(BlockState* s, const Hash* h, const unsigned char* array,
     }
 
 
-#ifdef USE_HASH_SAME_HASH
+#ifdef USE_HASH_SAME
     /* Switch to the other hash once this will be more efficient. */
-    if (hhead != h->head2 && bestlength >= h->same[hpos] &&
+    if (samehash && hhead != h->head2 && bestlength >= h->same[hpos] &&
         h->val2 == h->hashval2[p]) {
       /* Now use the hash that encodes the length and first byte. */
       hhead = h->head2;
@@ -328,11 +393,10 @@ void FindLongestMatch(BlockState* s, const Hash* h, const unsigned char* array,
 
     dist += p < pp ? pp - p : ((WINDOW_SIZE - p) + pp);
 
-#if MAX_CHAIN_HITS < WINDOW_SIZE
     chain_counter--;
     if (chain_counter <= 0) break;
-#endif
   }
+  s->chainsteps += s->options->chainhits - chain_counter;
 
 #ifdef USE_LONGEST_MATCH_CACHE
   StoreInLongestMatchCache(s, pos, limit, sublen, bestdist, bestlength);
@@ -343,12 +407,165 @@ void FindLongestMatch(BlockState* s, const Hash* h, const unsigned char* array,
   *distance = bestdist;
   *length = bestlength;
   assert(pos + *length <= size);
+#ifndef USE_HASH_SAME
+  (void)samehash;
+#endif
 }
 
-void LZ77Greedy(BlockState* s, const unsigned char* in,
-                size_t instart, size_t inend,
-                LZ77Store* store) {
-  size_t i = 0, j;
+static void FindLongestMatchSameHash(BlockState* s, Hash* h,
+    const unsigned char* array, size_t pos, size_t size, size_t limit,
+    unsigned short* sublen, unsigned short* distance, unsigned short* length) {
+  FindLongestMatchKernel(s, h, array, pos, size, limit,
+                         sublen, distance, length, 1, 0);
+}
+
+static void FindLongestMatchSingleHash(BlockState* s, Hash* h,
+    const unsigned char* array, size_t pos, size_t size, size_t limit,
+    unsigned short* sublen, unsigned short* distance, unsigned short* length) {
+  FindLongestMatchKernel(s, h, array, pos, size, limit,
+                         sublen, distance, length, 0, 0);
+}
+
+static void FindLongestMatchSameHashHints(BlockState* s, Hash* h,
+    const unsigned char* array, size_t pos, size_t size, size_t limit,
+    unsigned short* sublen, unsigned short* distance, unsigned short* length) {
+  FindLongestMatchKernel(s, h, array, pos, size, limit,
+                         sublen, distance, length, 1, 1);
+}
+
+static void FindLongestMatchSingleHashHints(BlockState* s, Hash* h,
+    const unsigned char* array, size_t pos, size_t size, size_t limit,
+    unsigned short* sublen, unsigned short* distance, unsigned short* length) {
+  FindLongestMatchKernel(s, h, array, pos, size, limit,
+                         sublen, distance, length, 0, 1);
+}
+
+/*
+The match finder for Options.binarytree. Adding pos to the tree finds its
+matches for every length, so those are only cut down to the limit here.
+*/
+static void FindLongestMatchTree(BlockState* s, Hash* h,
+    const unsigned char* array, size_t pos, size_t size, size_t limit,
+    unsigned short* sublen, unsigned short* distance, unsigned short* length) {
+  double steps = h->treesteps;
+  unsigned short bestlength;
+
+#ifdef USE_LONGEST_MATCH_CACHE
+  if (TryGetFromLongestMatchCache(s, pos, &limit, sublen, distance, length)) {
+    assert(pos + *length <= size);
+    return;
+  }
+#endif
+
+  assert(limit <= MAX_MATCH);
+  assert(limit >= MIN_MATCH);
+  assert(pos < size);
+
+  if (size - pos < MIN_MATCH) {
+    /* As in FindLongestMatchKernel. This also keeps the last bytes, which the
+    cache does not store, from bringing the tree up to date on every pass. */
+    *length = 0;
+    *distance = 0;
+    return;
+  }
+
+  if (h->treenext <= pos) {
+    UpdateTree(array, pos, size, h);
+    s->chainsteps += h->treesteps - steps;
+  }
+  assert(h->treepos == pos);
+
+#ifdef USE_LONGEST_MATCH_CACHE
+  /* The tree always has the matches for MAX_MATCH, whatever the limit. */
+  StoreInLongestMatchCache(s, pos, MAX_MATCH, h->treesublen,
+      h->treelength >= MIN_MATCH ? h->treesublen[h->treelength] : 0,
+      h->treelength);
+#endif
+
+  bestlength = h->treelength < limit ? h->treelength : limit;
+  if (sublen) {
+    unsigned short j;
+    for (j = MIN_MATCH; j <= bestlength; j++) sublen[j] = h->treesublen[j];
+  }
+  *distance = bestlength >= 2 ? h->treesublen[bestlength] : 0;
+  *length = bestlength;
+  assert(pos + *length <= size);
+}
+
+/* Adds dist to the sorted hint distances of the block state, if usable. */
+static void AddHintDist(size_t dist, BlockState* s) {
+  int i, j;
+  if (dist == 0 || dist >= WINDOW_SIZE) return;
+  for (i = 0; i < s->numhintdists; i++) {
+    if (s->hintdists[i] == dist) return;
+    if (s->hintdists[i] > dist) break;
+  }
+  for (j = s->numhintdists; j > i; j--) s->hintdists[j] = s->hintdists[j - 1];
+  s->hintdists[i] = dist;
+  s->numhintdists++;
+}
+
+void InitBlockState(const Options* options, size_t blockstart, size_t blockend,
+                    int usecache, BlockState* s) {
+  s->options = options;
+  s->blockstart = blockstart;
+  s->blockend = blockend;
+  s->chainsteps = 0;
+  s->numhintdists = 0;
+  if (options->rowstride > 0) {
+    /* The pixel to the left, the pixels above, and the row above that. */
+    size_t stride = options->rowstride;
+    size_t pixel = options->pixelsize > 0 ? options->pixelsize : 1;
+    AddHintDist(pixel, s);
+    AddHintDist(stride - pixel, s);
+    AddHintDist(stride, s);
+    AddHintDist(stride + pixel, s);
+    AddHintDist(stride * 2, s);
+  }
+  if (options->binarytree) {
+    /* The tree finds the nearest match of each length anyway. */
+    s->findlongestmatch = FindLongestMatchTree;
+  } else if (s->numhintdists > 0) {
+    s->findlongestmatch = options->samehash
+        ? FindLongestMatchSameHashHints : FindLongestMatchSingleHashHints;
+  } else {
+    s->findlongestmatch = options->samehash
+        ? FindLongestMatchSameHash : FindLongestMatchSingleHash;
+  }
+#ifdef USE_LONGEST_MATCH_CACHE
+  s->lmc = 0;
+  if (usecache) {
+    s->lmc = (LongestMatchCache*)ArenaAllocate(options->arena,
+                                               sizeof(LongestMatchCache));
+    InitLongestMatchCache(blockend - blockstart, options->cachedlengths,
+                          options->cachememory, options->arena, s->lmc);
+  }
+#else
+  (void)usecache;
+#endif
+}
+
+void CleanBlockState(BlockState* s) {
+  if (!s->options->stats) return;
+  s->options->stats->chainsteps += s->chainsteps;
+#ifdef USE_LONGEST_MATCH_CACHE
+  if (s->lmc) {
+    s->options->stats->cachelookups += s->lmc->lookups;
+    s->options->stats->cachehits += s->lmc->hits;
+  }
+#endif
+}
+
+/*
+LZ77Greedy with lazymatching being Options.lazymatching. Like
+FindLongestMatchKernel, this is only called with a constant switch, so the test
+is not repeated at every position.
+*/
+static FORCE_INLINE void LZ77GreedyKernel(BlockState* s,
+                                          const unsigned char* in,
+                                          size_t instart, size_t inend,
+                                          LZ77Store* store, int lazymatching) {
+  size_t i = 0;
   unsigned short leng;
   unsigned short dist;
   int lengvalue;
@@ -357,18 +574,20 @@ void LZ77Greedy(BlockState* s, const unsigned char* in,
 
   Hash hash;
   Hash* h = &hash;
+  ArenaMark mark;
 
-#ifdef LAZY_MATCHING
   /* Lazy matching. */
   unsigned prev_length = 0;
   unsigned prev_match = 0;
   int prevlengvalue;
   int match_available = 0;
-#endif
 
   if (instart == inend) return;
 
-  InitHash(WINDOW_SIZE, h);
+  ReserveLZ77Store(store->size + (inend - instart), store);
+
+  mark = GetArenaMark(s->options->arena);
+  InitHash(WINDOW_SIZE, s->options, h);
   WarmupHash(in, windowstart, inend, h);
   for (i = windowstart; i < instart; i++) {
     UpdateHash(in, i, inend, h);
@@ -377,46 +596,45 @@ void LZ77Greedy(BlockState* s, const unsigned char* in,
   for (i = instart; i < inend; i++) {
     UpdateHash(in, i, inend, h);
 
-    FindLongestMatch(s, h, in, i, inend, MAX_MATCH, dummysublen, &dist, &leng);
+    s->findlongestmatch(s, h, in, i, inend, MAX_MATCH, dummysublen,
+                        &dist, &leng);
     lengvalue = GetLengthValue(leng, dist);
 
-#ifdef LAZY_MATCHING
     /* Lazy matching. */
-    prevlengvalue = GetLengthValue(prev_length, prev_match);
-    if (match_available) {
-      match_available = 0;
-      if (lengvalue > prevlengvalue + 1) {
-        StoreLitLenDist(in[i - 1], 0, store);
-        if (lengvalue >= MIN_MATCH && lengvalue < MAX_MATCH) {
-          match_available = 1;
-          prev_length = leng;
-          prev_match = dist;
+    if (lazymatching) {
+      prevlengvalue = GetLengthValue(prev_length, prev_match);
+      if (match_available) {
+        match_available = 0;
+        if (lengvalue > prevlengvalue + 1) {
+          StoreLitLenDist(in[i - 1], 0, store);
+          if (lengvalue >= MIN_MATCH && lengvalue < MAX_MATCH) {
+            match_available = 1;
+            prev_length = leng;
+            prev_match = dist;
+            continue;
+          }
+        } else {
+          /* Add previous to output. */
+          leng = prev_length;
+          dist = prev_match;
+          lengvalue = prevlengvalue;
+          /* Add to output. */
+          VerifyLenDist(in, inend, i - 1, dist, leng);
+          StoreLitLenDist(leng, dist, store);
+          assert(i + leng - 2 < inend);
+          UpdateHashRange(in, i + 1, leng - 2, inend, h);
+          i += leng - 2;
           continue;
         }
-      } else {
-        /* Add previous to output. */
-        leng = prev_length;
-        dist = prev_match;
-        lengvalue = prevlengvalue;
-        /* Add to output. */
-        VerifyLenDist(in, inend, i - 1, dist, leng);
-        StoreLitLenDist(leng, dist, store);
-        for (j = 2; j < leng; j++) {
-          assert(i < inend);
-          i++;
-          UpdateHash(in, i, inend, h);
-        }
+      }
+      else if (lengvalue >= MIN_MATCH && leng < MAX_MATCH) {
+        match_available = 1;
+        prev_length = leng;
+        prev_match = dist;
         continue;
       }
     }
-    else if (lengvalue >= MIN_MATCH && leng < MAX_MATCH) {
-      match_available = 1;
-      prev_length = leng;
-      prev_match = dist;
-      continue;
-    }
     /* End of lazy matching. */
-#endif
 
     /* Add to output. */
     if (lengvalue >= MIN_MATCH) {
@@ -426,14 +644,32 @@ void LZ77Greedy(BlockState* s, const unsigned char* in,
       leng = 1;
       StoreLitLenDist(in[i], 0, store);
     }
-    for (j = 1; j < leng; j++) {
-      assert(i < inend);
-      i++;
-      UpdateHash(in, i, inend, h);
-    }
+    assert(i + leng <= inend);
+    UpdateHashRange(in, i + 1, leng - 1, inend, h);
+    i += leng - 1;
   }
 
-  CleanHash(h);
+  ReleaseArena(s->options->arena, mark);
+}
+
+static void LZ77GreedyLazy(BlockState* s, const unsigned char* in,
+                           size_t instart, size_t inend, LZ77Store* store) {
+  LZ77GreedyKernel(s, in, instart, inend, store, 1);
+}
+
+static void LZ77GreedyNoLazy(BlockState* s, const unsigned char* in,
+                             size_t instart, size_t inend, LZ77Store* store) {
+  LZ77GreedyKernel(s, in, instart, inend, store, 0);
+}
+
+void LZ77Greedy(BlockState* s, const unsigned char* in,
+                size_t instart, size_t inend,
+                LZ77Store* store) {
+  if (s->options->lazymatching) {
+    LZ77GreedyLazy(s, in, instart, inend, store);
+  } else {
+    LZ77GreedyNoLazy(s, in, instart, inend, store);
+  }
 }
 
 void GetLZ77Counts(const unsigned short* litlens, const unsigned short* dists,
@@ -36,42 +36,47 @@ Stores lit/length and dist pairs for LZ77.
 litlens: Contains the literal symbols or length values.
 dists: Indicates the distance, or 0 to indicate that there is no distance and
 litlens contains a literal instead of a length.
-litlens and dists both have the same size.
+litlens and dists both have the same size, and are parts of a single allocation
+from the arena that holds capacity values of each.
 */
 typedef struct LZ77Store {
   unsigned short* litlens;  /* Lit or len. */
   unsigned short* dists;  /* If 0: indicates literal in corresponding litlens,
       if > 0: length in corresponding litlens, this is the distance. */
   size_t size;
+  size_t capacity;  /* Amount of values litlens and dists have room for. */
+  Arena* arena;  /* Where litlens and dists are allocated. */
 } LZ77Store;
 
-void InitLZ77Store(LZ77Store* store);
-void CleanLZ77Store(LZ77Store* store);
+/* Initializes an empty store, which will allocate from the arena. */
+void InitLZ77Store(Arena* arena, LZ77Store* store);
 void CopyLZ77Store(const LZ77Store* source, LZ77Store* dest);
-void StoreLitLenDist(unsigned short length, unsigned short dist,
-                     LZ77Store* store);
 
 /*
-Some state information for compressing a block.
-This is currently a bit under-used (with mainly only the longest match cache),
-but is kept for easy future expansion.
+Makes room for at least capacity values, keeping the stored ones. An LZ77
+encoding of n bytes never has more than n values, so reserving the block size
+up front means the store is never grown while symbols are added.
 */
-typedef struct BlockState {
-  const Options* options;
+void ReserveLZ77Store(size_t capacity, LZ77Store* store);
 
-#ifdef USE_LONGEST_MATCH_CACHE
-  /* Cache for length/distance pairs found so far. */
-  LongestMatchCache* lmc;
-#endif
+/* Empties the store, but keeps its memory for reuse. */
+void ClearLZ77Store(LZ77Store* store);
 
-  /* The start (inclusive) and end (not inclusive) of the current block. */
-  size_t blockstart;
-  size_t blockend;
-} BlockState;
+/*
+Exchanges the contents of the two stores, without copying any values. Both must
+use the same arena.
+*/
+void SwapLZ77Store(LZ77Store* a, LZ77Store* b);
+
+void StoreLitLenDist(unsigned short length, unsigned short dist,
+                     LZ77Store* store);
+
+typedef struct BlockState BlockState;
 
 /*
 Finds the longest match (length and corresponding distance) for LZ77
-compression.
+compression. Use the findlongestmatch function of the BlockState, which is
+specialized for its options.
 Even when not using "sublen", it can be more efficient to provide an array,
 because only then the caching is used.
 array: the data
@@ -85,12 +90,53 @@ sublen: output array of 259 elements, or null. Has, for each length, the
     are used, the first 3 are ignored (the shortest length is 3. It is purely
     for convenience that the array is made 3 longer).
 */
-
-void FindLongestMatch(
-    BlockState *s, const Hash* h, const unsigned char* array,
+typedef void FindLongestMatchFun(
+    BlockState *s, Hash* h, const unsigned char* array,
     size_t pos, size_t size, size_t limit,
     unsigned short* sublen, unsigned short* distance, unsigned short* length);
 
+/*
+Some state information for compressing a block.
+This is currently a bit under-used (with mainly only the longest match cache),
+but is kept for easy future expansion.
+*/
+struct BlockState {
+  const Options* options;
+
+#ifdef USE_LONGEST_MATCH_CACHE
+  /* Cache for length/distance pairs found so far. */
+  LongestMatchCache* lmc;
+#endif
+
+  /* The start (inclusive) and end (not inclusive) of the current block. */
+  size_t blockstart;
+  size_t blockend;
+
+  /* The match finder, chosen once for the options. */
+  FindLongestMatchFun* findlongestmatch;
+
+  /* Distances the match finder tries first, ascending (Options.rowstride). */
+  unsigned hintdists[5];
+  int numhintdists;
+
+  /* Hash chain entries visited, see CompressionStats. */
+  double chainsteps;
+};
+
+/*
+Initializes the state for compressing the block from blockstart to blockend.
+usecache: whether to give it a longest match cache, allocated from the arena of
+    the options. This has no effect if USE_LONGEST_MATCH_CACHE is not defined.
+*/
+void InitBlockState(const Options* options, size_t blockstart, size_t blockend,
+                    int usecache, BlockState* s);
+
+/*
+Adds the counters of the block state (cache hits, chain steps) to the stats of
+its options. Its memory belongs to the arena and is released with it.
+*/
+void CleanBlockState(BlockState* s);
+
 /*
 Verifies if length and dist are indeed valid, only used for assertion.
 */
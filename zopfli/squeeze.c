@@ -73,24 +73,22 @@ static void AddWeighedStatFreqs(const SymbolStats* stats1, double w1,
 }
 
 /* Get random number: "Multiply-With-Carry" generator of G. Marsaglia */
-static unsigned int Ran() {
-  static unsigned int m_w = 1;
-  static unsigned int m_z = 2;
-  m_z = 36969 * (m_z & 65535) + (m_z >> 16);
-  m_w = 18000 * (m_w & 65535) + (m_w >> 16);
-  return (m_z << 16) + m_w;  /* 32-bit result. */
+static unsigned int Ran(RandomState* state) {
+  state->m_z = 36969 * (state->m_z & 65535) + (state->m_z >> 16);
+  state->m_w = 18000 * (state->m_w & 65535) + (state->m_w >> 16);
+  return (state->m_z << 16) + state->m_w;  /* 32-bit result. */
 }
 
-static void RandomizeFreqs(size_t* freqs, int n) {
+static void RandomizeFreqs(RandomState* state, size_t* freqs, int n) {
   int i;
   for (i = 0; i < n; i++) {
-    if ((Ran() >> 4) % 3 == 0) freqs[i] = freqs[Ran() % n];
+    if ((Ran(state) >> 4) % 3 == 0) freqs[i] = freqs[Ran(state) % n];
   }
 }
 
-static void RandomizeStatFreqs(SymbolStats* stats) {
-  RandomizeFreqs(stats->litlens, 288);
-  RandomizeFreqs(stats->dists, 32);
+static void RandomizeStatFreqs(RandomState* state, SymbolStats* stats) {
+  RandomizeFreqs(state, stats->litlens, 288);
+  RandomizeFreqs(state, stats->dists, 32);
   stats->litlens[256] = 1;  /* End symbol. */
 }
 
@@ -196,13 +194,14 @@ costmodel: function to calculate the cost of some lit/len/dist pair.
 costcontext: abstract context for the costmodel function
 length_array: output array of size (inend - instart) which will receive the best
     length to reach this byte from a previous byte.
+shortcut: Options.shortcutrepetitions. This is only called with a constant
+    value, so each caller gets a copy without the test in the loop.
 returns the cost that was, according to the costmodel, needed to get to the end.
 */
-static double GetBestLengths(BlockState *s,
-                             const unsigned char* in,
-                             size_t instart, size_t inend,
-                             CostModelFun* costmodel, void* costcontext,
-                             unsigned short* length_array) {
+static FORCE_INLINE double GetBestLengthsKernel(
+    BlockState *s, const unsigned char* in, size_t instart, size_t inend,
+    CostModelFun* costmodel, void* costcontext, unsigned short* length_array,
+    int shortcut) {
   /* Best cost to get here so far. */
   size_t blocksize = inend - instart;
   float* costs;
@@ -215,13 +214,15 @@ static double GetBestLengths(BlockState *s,
   Hash* h = &hash;
   double result;
   double mincost = GetCostModelMinCost(costmodel, costcontext);
+  ArenaMark mark;
 
   if (instart == inend) return 0;
 
-  costs = (float*)malloc(sizeof(float) * (blocksize + 1));
-  if (!costs) exit(-1); /* Allocation failed. */
+  mark = GetArenaMark(s->options->arena);
+  costs = (float*)ArenaAllocate(s->options->arena,
+                                sizeof(float) * (blocksize + 1));
 
-  InitHash(WINDOW_SIZE, h);
+  InitHash(WINDOW_SIZE, s->options, h);
   WarmupHash(in, windowstart, inend, h);
   for (i = windowstart; i < instart; i++) {
     UpdateHash(in, i, inend, h);
@@ -235,10 +236,11 @@ static double GetBestLengths(BlockState *s,
     size_t j = i - instart;  /* Index in the costs array and length_array. */
     UpdateHash(in, i, inend, h);
 
-#ifdef SHORTCUT_LONG_REPETITIONS
+#ifdef USE_HASH_SAME
     /* If we're in a long repetition of the same character and have more than
     MAX_MATCH characters before and after our position. */
-    if (h->same[i & WINDOW_MASK] > MAX_MATCH * 2
+    if (shortcut
+        && h->same[i & WINDOW_MASK] > MAX_MATCH * 2
         && i > instart + MAX_MATCH + 1
         && i + MAX_MATCH * 2 + 1 < inend
         && h->same[(i - MAX_MATCH) & WINDOW_MASK] > MAX_MATCH) {
@@ -251,12 +253,13 @@ static double GetBestLengths(BlockState *s,
         length_array[j + MAX_MATCH] = MAX_MATCH;
         i++;
         j++;
-        UpdateHash(in, i, inend, h);
       }
+      UpdateHashRange(in, i - MAX_MATCH + 1, MAX_MATCH - 1, inend, h);
+      UpdateHash(in, i, inend, h);
     }
 #endif
 
-    FindLongestMatch(s, h, in, i, inend, MAX_MATCH, sublen, &dist, &leng);
+    s->findlongestmatch(s, h, in, i, inend, MAX_MATCH, sublen, &dist, &leng);
 
     /* Literal. */
     if (i + 1 <= inend) {
@@ -288,24 +291,41 @@ static double GetBestLengths(BlockState *s,
   assert(costs[blocksize] >= 0);
   result = costs[blocksize];
 
-  CleanHash(h);
-  free(costs);
+  ReleaseArena(s->options->arena, mark);
+#ifndef USE_HASH_SAME
+  (void)shortcut;
+#endif
 
   return result;
 }
 
+/* GetBestLengthsKernel for the options of the block state. */
+static double GetBestLengths(BlockState *s,
+                             const unsigned char* in,
+                             size_t instart, size_t inend,
+                             CostModelFun* costmodel, void* costcontext,
+                             unsigned short* length_array) {
+  if (s->options->shortcutrepetitions) {
+    return GetBestLengthsKernel(s, in, instart, inend, costmodel, costcontext,
+                                length_array, 1);
+  }
+  return GetBestLengthsKernel(s, in, instart, inend, costmodel, costcontext,
+                              length_array, 0);
+}
+
 /*
 Calculates the optimal path of lz77 lengths to use, from the calculated
 length_array. The length_array must contain the optimal length to reach that
 byte. The path will be filled with the lengths to use, so its data size will be
-the amount of lz77 symbols.
+the amount of lz77 symbols. path must have room for size values.
 */
 static void TraceBackwards(size_t size, const unsigned short* length_array,
-                           unsigned short** path, size_t* pathsize) {
+                           unsigned short* path, size_t* pathsize) {
   size_t index = size;
+  *pathsize = 0;
   if (size == 0) return;
   for (;;) {
-    APPEND_DATA(length_array[index], path, pathsize);
+    path[(*pathsize)++] = length_array[index];
     assert(length_array[index] <= index);
     assert(length_array[index] <= MAX_MATCH);
     assert(length_array[index] != 0);
@@ -315,9 +335,9 @@ static void TraceBackwards(size_t size, const unsigned short* length_array,
 
   /* Mirror result. */
   for (index = 0; index < *pathsize / 2; index++) {
-    unsigned short temp = (*path)[index];
-    (*path)[index] = (*path)[*pathsize - index - 1];
-    (*path)[*pathsize - index - 1] = temp;
+    unsigned short temp = path[index];
+    path[index] = path[*pathsize - index - 1];
+    path[*pathsize - index - 1] = temp;
   }
 }
 
@@ -325,17 +345,21 @@ static void FollowPath(BlockState* s,
                        const unsigned char* in, size_t instart, size_t inend,
                        unsigned short* path, size_t pathsize,
                        LZ77Store* store) {
-  size_t i, j, pos = 0;
+  size_t i, pos = 0;
   size_t windowstart = instart > WINDOW_SIZE ? instart - WINDOW_SIZE : 0;
 
   size_t total_length_test = 0;
 
   Hash hash;
   Hash* h = &hash;
+  ArenaMark mark;
 
   if (instart == inend) return;
 
-  InitHash(WINDOW_SIZE, h);
+  ReserveLZ77Store(store->size + pathsize, store);
+
+  mark = GetArenaMark(s->options->arena);
+  InitHash(WINDOW_SIZE, s->options, h);
   WarmupHash(in, windowstart, inend, h);
   for (i = windowstart; i < instart; i++) {
     UpdateHash(in, i, inend, h);
@@ -354,7 +378,8 @@ static void FollowPath(BlockState* s,
     if (length >= MIN_MATCH) {
       /* Get the distance by recalculating longest match. The found length
       should match the length from the path. */
-      FindLongestMatch(s, h, in, pos, inend, length, 0, &dist, &dummy_length);
+      s->findlongestmatch(s, h, in, pos, inend, length, 0,
+                          &dist, &dummy_length);
       assert(!(dummy_length != length && length > 2 && dummy_length > 2));
       VerifyLenDist(in, inend, pos, dist, length);
       StoreLitLenDist(length, dist, store);
@@ -367,14 +392,12 @@ static void FollowPath(BlockState* s,
 
 
     assert(pos + length <= inend);
-    for (j = 1; j < length; j++) {
-      UpdateHash(in, pos + j, inend, h);
-    }
+    UpdateHashRange(in, pos + 1, length - 1, inend, h);
 
     pos += length;
   }
 
-  CleanHash(h);
+  ReleaseArena(s->options->arena, mark);
 }
 
 /* Calculates the entropy of the statistics */
@@ -399,6 +422,32 @@ static void GetStatistics(const LZ77Store* store, SymbolStats* stats) {
   CalculateStatistics(stats);
 }
 
+/* Returns whether the cost profile holds any statistics yet. */
+static int HasProfileStatistics(const CostProfile* profile) {
+  size_t i;
+  for (i = 0; i < 288; i++) {
+    if (profile->litlens[i] != 0) return 1;
+  }
+  return 0;
+}
+
+/* Gets the statistics from the frequencies in the cost profile. */
+static void GetProfileStatistics(const CostProfile* profile,
+                                 SymbolStats* stats) {
+  memcpy(stats->litlens, profile->litlens, 288 * sizeof(stats->litlens[0]));
+  memcpy(stats->dists, profile->dists, 32 * sizeof(stats->dists[0]));
+  stats->litlens[256] = 1;  /* End symbol. */
+
+  CalculateStatistics(stats);
+}
+
+/* Stores the frequencies of the statistics in the cost profile. */
+static void StoreProfileStatistics(const SymbolStats* stats,
+                                   CostProfile* profile) {
+  memcpy(profile->litlens, stats->litlens, 288 * sizeof(stats->litlens[0]));
+  memcpy(profile->dists, stats->dists, 32 * sizeof(stats->dists[0]));
+}
+
 /*
 Does a single run for LZ77Optimal. For good compression, repeated runs with
 updated statistics should be performed.
@@ -407,9 +456,9 @@ s: the block state
 in: the input data array
 instart: where to start
 inend: where to stop (not inclusive)
-path: pointer to dynamically allocated memory to store the path
-pathsize: pointer to the size of the dynamic path array
-length_array: array if size (inend - instart) used to store lengths
+path: array of size (inend - instart) to store the path
+pathsize: receives the amount of values stored in path
+length_array: array if size (inend - instart + 1) used to store lengths
 costmodel: function to use as the cost model for this squeeze run
 costcontext: abstract context for the costmodel function
 store: place to output the LZ77 data
@@ -418,42 +467,94 @@ returns the cost that was, according to the costmodel, needed to get to the end.
 */
 static double LZ77OptimalRun(BlockState* s,
     const unsigned char* in, size_t instart, size_t inend,
-    unsigned short** path, size_t* pathsize,
+    unsigned short* path, size_t* pathsize,
     unsigned short* length_array, CostModelFun* costmodel,
     void* costcontext, LZ77Store* store) {
   double cost = GetBestLengths(
       s, in, instart, inend, costmodel, costcontext, length_array);
-  free(*path);
-  *path = 0;
-  *pathsize = 0;
   TraceBackwards(inend - instart, length_array, path, pathsize);
-  FollowPath(s, in, instart, inend, *path, *pathsize, store);
+  FollowPath(s, in, instart, inend, path, *pathsize, store);
   assert(cost < LARGE_FLOAT);
   return cost;
 }
 
+/*
+Returns whether the iterations of LZ77Optimal converged: the best cost did not
+improve significantly during the last convergenceiterations iterations.
+iterations: the amount of iterations done so far
+lastgain: the iteration after which the best cost last improved significantly
+*/
+static int IterationsConverged(const Options* options,
+                               int iterations, int lastgain) {
+  return options->convergenceiterations > 0
+      && iterations - lastgain >= options->convergenceiterations;
+}
+
+/*
+Returns whether the block or file time limit ran out.
+starttime: the time at which the block started
+*/
+static int TimeLimitReached(const Options* options, double starttime) {
+  double now;
+  if (options->blocktimelimit <= 0 && options->filedeadline <= 0) return 0;
+  now = GetSeconds();
+  if (options->blocktimelimit > 0
+      && now - starttime >= options->blocktimelimit) {
+    return 1;
+  }
+  return options->filedeadline > 0 && now >= options->filedeadline;
+}
+
 void LZ77Optimal(BlockState *s,
                  const unsigned char* in, size_t instart, size_t inend,
                  LZ77Store* store) {
   /* Dist to get to here with smallest cost. */
   size_t blocksize = inend - instart;
-  unsigned short* length_array =
-      (unsigned short*)malloc(sizeof(unsigned short) * (blocksize + 1));
-  unsigned short* path = 0;
+  unsigned short* length_array;
+  unsigned short* path;
   size_t pathsize = 0;
   LZ77Store currentstore;
-  SymbolStats stats, beststats, laststats;
+  SymbolStats stats, beststats, laststats, profilestats;
   int i;
   double cost;
+  double profilecost = LARGE_FLOAT;
   double bestcost = LARGE_FLOAT;
   double lastcost = 0;
   /* Try randomizing the costs a bit once the size stabilizes. */
   int lastrandomstep = -1;
-
-  if (!length_array) exit(-1); /* Allocation failed. */
-
+  /* For stopping early, see IterationsConverged and TimeLimitReached. */
+  double gaincost = LARGE_FLOAT;
+  int lastgain = 0;
+  int iterations = 0;
+  CompressionStage stage = STAGE_COMPLETE;
+  double starttime = GetSeconds();
+  CostProfile* profile = s->options->costprofile;
+  RandomState localrandom;
+  RandomState* random = s->options->randomstate;
+  int warmstart = 0;  /* Whether the result comes from the profile run. */
+  int profileruns = 0;
+  ArenaMark mark;
+
+  if (!random) {
+    InitRandomState(&localrandom);
+    random = &localrandom;
+  }
   InitStats(&stats);
-  InitLZ77Store(&currentstore);
+  InitLZ77Store(s->options->arena, &currentstore);
+
+  /* Both stores can hold the largest possible result, so that none of the runs
+  needs to grow them, and the best one is kept by swapping the two. Since the
+  output store may end up with either allocation, both are made before the
+  mark, and only the scratch memory below is released at the end. */
+  ReserveLZ77Store(blocksize, &currentstore);
+  ClearLZ77Store(store);
+  ReserveLZ77Store(blocksize, store);
+
+  mark = GetArenaMark(s->options->arena);
+  length_array = (unsigned short*)ArenaAllocate(s->options->arena,
+      sizeof(unsigned short) * (blocksize + 1));
+  path = (unsigned short*)ArenaAllocate(s->options->arena,
+      sizeof(unsigned short) * (blocksize + 1));
 
   /* Do regular deflate, then loop multiple shortest path runs, each time using
   the statistics of the previous run. */
@@ -462,25 +563,59 @@ void LZ77Optimal(BlockState *s,
   LZ77Greedy(s, in, instart, inend, &currentstore);
   GetStatistics(&currentstore, &stats);
 
+  if (s->options->numiterations > 0
+      && (TimeLimitReached(s->options, starttime)
+          || PollProgress(s->options))) {
+    /* No time for any iteration, the greedy result is the best one there is. */
+    SwapLZ77Store(&currentstore, store);
+    stage = STAGE_GREEDY;
+  }
+
+  /* With a cost profile, a first run is also done from its statistics. The
+  iterations only go on from there if that run came out smaller than the first
+  run from the greedy statistics: a profile that does not fit the block then
+  costs one run, rather than the many more it takes to converge from it. */
+  if (profile && HasProfileStatistics(profile)
+      && s->options->numiterations > 0 && stage == STAGE_COMPLETE) {
+    GetProfileStatistics(profile, &profilestats);
+    LZ77OptimalRun(s, in, instart, inend, path, &pathsize,
+                   length_array, GetCostStat, (void*)&profilestats, store);
+    profilecost = CalculateBlockSize(store->litlens, store->dists,
+                                     0, store->size, 2);
+    CopyStats(&profilestats, &beststats);
+    bestcost = gaincost = profilecost;
+    ClearStatFreqs(&profilestats);
+    GetStatistics(store, &profilestats);
+    profileruns = 1;
+    warmstart = 1;
+    if (TimeLimitReached(s->options, starttime)) stage = STAGE_PARTIAL;
+  }
+
   /* Repeat statistics with each time the cost model from the previous stat
   run. */
-  for (i = 0; i < s->options->numiterations; i++) {
-    CleanLZ77Store(&currentstore);
-    InitLZ77Store(&currentstore);
-    LZ77OptimalRun(s, in, instart, inend, &path, &pathsize,
+  for (i = 0; i < s->options->numiterations && stage == STAGE_COMPLETE; i++) {
+    LZ77Store* runstore = &currentstore;  /* Holds the result of this run. */
+    ClearLZ77Store(&currentstore);
+    LZ77OptimalRun(s, in, instart, inend, path, &pathsize,
                    length_array, GetCostStat, (void*)&stats,
                    &currentstore);
     cost = CalculateBlockSize(currentstore.litlens, currentstore.dists,
                               0, currentstore.size, 2);
     if (cost < bestcost) {
-      /* Copy to the output store. */
-      CopyLZ77Store(&currentstore, store);
+      /* Move to the output store, the previous best becomes the scratch store
+      for the next run. */
+      SwapLZ77Store(&currentstore, store);
+      runstore = store;
       CopyStats(&stats, &beststats);
       bestcost = cost;
+      if (cost < gaincost * (1 - s->options->convergencethreshold)) {
+        gaincost = cost;
+        lastgain = i + 1;
+      }
     }
     CopyStats(&stats, &laststats);
     ClearStatFreqs(&stats);
-    GetStatistics(&currentstore, &stats);
+    GetStatistics(runstore, &stats);
     if (lastrandomstep != -1) {
       /* This makes it converge slower but better. Do it only once the
       randomness kicks in so that if the user does few iterations, it gives a
@@ -490,16 +625,39 @@ void LZ77Optimal(BlockState *s,
     }
     if (i > 5 && cost == lastcost) {
       CopyStats(&beststats, &stats);
-      RandomizeStatFreqs(&stats);
+      RandomizeStatFreqs(random, &stats);
       CalculateStatistics(&stats);
       lastrandomstep = i;
     }
+    if (i == 0 && profileruns > 0) {
+      warmstart = profilecost < cost;
+      if (warmstart) CopyStats(&profilestats, &stats);
+    }
     lastcost = cost;
+    iterations = i + 1;
+    if (ReportProgress(s->options, instart +
+        (double)blocksize * iterations / s->options->numiterations)) {
+      break;
+    }
+    if (iterations == s->options->numiterations) break;
+    if (IterationsConverged(s->options, iterations, lastgain)) break;
+    if (TimeLimitReached(s->options, starttime)) stage = STAGE_PARTIAL;
   }
 
-  free(length_array);
-  free(path);
-  CleanLZ77Store(&currentstore);
+  if (profile && store->size > 0) {
+    ClearStatFreqs(&stats);
+    GetStatistics(store, &stats);
+    StoreProfileStatistics(&stats, profile);
+  }
+
+  if (s->options->stats) {
+    s->options->stats->blocks++;
+    s->options->stats->iterations += iterations + profileruns;
+    if (warmstart) s->options->stats->warmblocks++;
+    if (stage > s->options->stats->stage) s->options->stats->stage = stage;
+  }
+
+  ReleaseArena(s->options->arena, mark);
 }
 
 void LZ77OptimalFixed(BlockState *s,
@@ -508,21 +666,26 @@ void LZ77OptimalFixed(BlockState *s,
 {
   /* Dist to get to here with smallest cost. */
   size_t blocksize = inend - instart;
-  unsigned short* length_array =
-      (unsigned short*)malloc(sizeof(unsigned short) * (blocksize + 1));
-  unsigned short* path = 0;
+  unsigned short* length_array;
+  unsigned short* path;
   size_t pathsize = 0;
-
-  if (!length_array) exit(-1); /* Allocation failed. */
+  ArenaMark mark;
 
   s->blockstart = instart;
   s->blockend = inend;
 
   /* Shortest path for fixed tree This one should give the shortest possible
-  result for fixed tree, no repeated runs are needed since the tree is known. */
-  LZ77OptimalRun(s, in, instart, inend, &path, &pathsize,
+  result for fixed tree, no repeated runs are needed since the tree is known.
+  The store is reserved before the mark, so that FollowPath does not grow it
+  into memory that is released below. */
+  ReserveLZ77Store(store->size + blocksize, store);
+  mark = GetArenaMark(s->options->arena);
+  length_array = (unsigned short*)ArenaAllocate(s->options->arena,
+      sizeof(unsigned short) * (blocksize + 1));
+  path = (unsigned short*)ArenaAllocate(s->options->arena,
+      sizeof(unsigned short) * (blocksize + 1));
+  LZ77OptimalRun(s, in, instart, inend, path, &pathsize,
                  length_array, GetCostFixed, 0, store);
 
-  free(length_array);
-  free(path);
+  ReleaseArena(s->options->arena, mark);
 }
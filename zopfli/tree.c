@@ -29,11 +29,13 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 
 void LengthsToSymbols(const unsigned* lengths, size_t n, unsigned maxbits,
                       unsigned* symbols) {
-  size_t* bl_count = (size_t*)malloc(sizeof(size_t) * (maxbits + 1));
-  size_t* next_code = (size_t*)malloc(sizeof(size_t) * (maxbits + 1));
+  size_t bl_count[16];  /* maxbits is at most 15 in deflate. */
+  size_t next_code[16];
   unsigned bits, i;
   unsigned code;
 
+  assert(maxbits <= 15);
+
   for (i = 0; i < n; i++) {
     symbols[i] = 0;
   }
@@ -63,11 +65,100 @@ void LengthsToSymbols(const unsigned* lengths, size_t n, unsigned maxbits,
       next_code[len]++;
     }
   }
-
-  free(bl_count);
-  free(next_code);
 }
 
+/*
+log(i) * kInvLog2 for i < 256, as CalculateEntropy would compute it with log(),
+so that looking a count up here gives bit-for-bit the same cost as before.
+*/
+static const double kLog2Table[256] = {
+    0, 0, 0.99999999999995604, 1.5849625007210868, 1.9999999999999121,
+    2.3219280948872605, 2.5849625007210428, 2.8073549220574807,
+    2.9999999999998681, 3.1699250014421736, 3.321928094887217,
+    3.4594316186371454, 3.5849625007209989, 3.7004397181409296,
+    3.8073549220574368, 3.9068905956083473, 3.9999999999998241,
+    4.0874628412501606, 4.1699250014421292, 4.2479275134433987,
+    4.3219280948871726, 4.392317422778568, 4.4594316186371019,
+    4.5235619560568141, 4.5849625007209553, 4.643856189774521,
+    4.7004397181408857, 4.7548875021632604, 4.8073549220573932,
+    4.8579809951273587, 4.9068905956083038, 4.9541963103866582,
+    4.9999999999997806, 5.0443941193582322, 5.0874628412501162,
+    5.1292830169447408, 5.1699250014420857, 5.209453365628721,
+    5.2479275134433552, 5.285402218862016, 5.321928094887129,
+    5.3575520046178484, 5.3923174227785236, 5.4262647547018599,
+    5.4594316186370575, 5.4918530963294332, 5.5235619560567706,
+    5.5545888516773934, 5.5849625007209118, 5.6147098441149614,
+    5.6438561897744766, 5.6724253419712465, 5.7004397181408422,
+    5.7279204545629483, 5.754887502163216, 5.7813597135244059,
+    5.8073549220573497, 5.8328900141644855, 5.8579809951273143,
+    5.8826430493615831, 5.9068905956082594, 5.9307373375626264,
+    5.9541963103866138, 5.9772799234996539, 5.9999999999997362,
+    6.0223678130281897, 6.0443941193581878, 6.0660891904575056,
+    6.0874628412500726, 6.1085244567779018, 6.1292830169446981,
+    6.1497471195044122, 6.1699250014420413, 6.1898245588797458,
+    6.2094533656286783, 6.2288186904956069, 6.2479275134433117,
+    6.2667865406946266, 6.2854022188619725, 6.303780748176826,
+    6.3219280948870846, 6.3398500028843472, 6.3575520046178049,
+    6.3750394313466456, 6.3923174227784791, 6.4093909361374211,
+    6.4262647547018155, 6.4429434958484455, 6.459431618637014,
+    6.4757334309661134, 6.4918530963293897, 6.5077946401984104,
+    6.5235619560567271, 6.539158811107745, 6.5545888516773498,
+    6.5698556083306592, 6.5849625007208674, 6.5999128421868383,
+    6.6147098441149188, 6.6293566200793181, 6.6438561897744339,
+    6.6582114827515033, 6.6724253419712021, 6.6865005271829254,
+    6.7004397181407978, 6.7142455176658276, 6.7279204545629039,
+    6.7414669864008507, 6.7548875021631725, 6.7681843247766293,
+    6.7813597135243624, 6.7944158663498078, 6.8073549220573044,
+    6.8201789624148885, 6.832890014164442, 6.8454900509440746,
+    6.8579809951272708, 6.8703647195831037, 6.8826430493615396,
+    6.8948177633076417, 6.9068905956082149, 6.9188632372742909,
+    6.930737337562582, 6.9425145053389343, 6.9541963103865703,
+    6.9657842846617823, 6.9772799234996103, 6.9886846867718591,
+    6.9999999999996927, 7.0112272554229467, 7.0223678130281462,
+    7.0334230015371411, 7.0443941193581443, 7.0552824355008799,
+    7.0660891904574621, 7.0768155970505209, 7.0874628412500291,
+    7.0980320829602155, 7.1085244567778574, 7.118941072723195,
+    7.1292830169446528, 7.1395513523984802, 7.1497471195043687,
+    7.1598713367780746, 7.1699250014419977, 7.1799090900146192,
+    7.1898245588797014, 7.1996723448360482, 7.209453365628633,
+    7.219168520461845, 7.2288186904955634, 7.2384047393247615,
+    7.2479275134432672, 7.2573878426923333, 7.2667865406945831,
+    7.2761244052739187, 7.285402218861929, 7.2946207488913064,
+    7.3037807481767825, 7.3128829552840342, 7.3219280948870402,
+    7.3309168781142953, 7.3398500028843019, 7.3487281542307548,
+    7.3575520046177614, 7.3663222142454918, 7.3750394313466021,
+    7.3837042924737286, 7.3923174227784356, 7.4008794362818593,
+    7.4093909361373766, 7.4178525148855732, 7.4262647547017719,
+    7.4346282276363986, 7.442943495848402, 7.4512111118320021,
+    7.4594316186369696, 7.467605550082669, 7.4757334309660699,
+    7.4838157772639278, 7.4918530963293462, 7.499845887082877,
+    7.5077946401983668, 7.5156998382837132, 7.5235619560566835,
+    7.5313814605159815, 7.5391588111077015, 7.546894459887306,
+    7.5545888516773063, 7.5622424242207416, 7.5698556083306157,
+    7.5774288280354165, 7.584962500720823, 7.5924570372677476,
+    7.5999128421867947, 7.6073303137492765, 7.6147098441148735,
+    7.6220518194560416, 7.6293566200792746, 7.6366246205433139,
+    7.6438561897743886, 7.6510516911785933, 7.6582114827514589,
+    7.6653359171848399, 7.6724253419711586, 7.6794800995051098,
+    7.686500527182881, 7.6934869574989877, 7.7004397181407542,
+    7.7073591320805441, 7.714245517665784, 7.7210991887068463,
+    7.7279204545628595, 7.734709620225499, 7.7414669864008072,
+    7.7481928495891195, 7.7548875021631289, 7.7615512324441394,
+    7.7681843247765849, 7.7747870596008326, 7.7813597135243189,
+    7.7879025593910898, 7.7944158663497634, 7.8008998999199628,
+    7.8073549220572609, 7.8137811912166946, 7.820178962414845,
+    7.8265484872905722, 7.8328900141643985, 7.8392037880966008,
+    7.8454900509440311, 7.8517490414157125, 7.8579809951272273,
+    7.8641861446539343, 7.8703647195830593, 7.8765169465646538,
+    7.8826430493614961, 7.8887432488979137, 7.8948177633075973,
+    7.9008668079804023, 7.9068905956081714, 7.9128893362296138,
+    7.9188632372742473, 7.9248125036054331, 7.9307373375625385,
+    7.9366379390022228, 7.9425145053388908, 7.9483672315843297,
+    7.9541963103865267, 7.9600019320677315, 7.965784284661737,
+    7.971543553950422, 7.9772799234995668, 7.9829935746939604,
+    7.9886846867718155, 7.994353436858507
+};
+
 void CalculateEntropy(const size_t* count, size_t n, double* bitlengths) {
   static const double kInvLog2 = 1.4426950408889;  /* 1.0 / log(2.0) */
   unsigned sum = 0;
@@ -82,6 +173,7 @@ void CalculateEntropy(const size_t* count, size_t n, double* bitlengths) {
     means the symbol will appear at least once anyway, so give it the cost as if
     its count is 1.*/
     if (count[i] == 0) bitlengths[i] = log2sum;
+    else if (count[i] < 256) bitlengths[i] = log2sum - kLog2Table[count[i]];
     else bitlengths[i] = log2sum - log(count[i]) * kInvLog2;
     /* Depending on compiler and architecture, the above subtraction of two
     floating point numbers may give a negative result very close to zero
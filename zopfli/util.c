@@ -17,12 +17,22 @@ Author: lode.vandevenne@gmail.com (Lode Vandevenne)
 Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 */
 
+#if !defined(_WIN32) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 500  /* For gettimeofday. */
+#endif
+
 #include "util.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
 int GetDistExtraBits(int dist) {
 #ifdef __GNUC__
   if (dist < 5) return 0;
@@ -207,4 +217,77 @@ void InitOptions(Options* options) {
   options->blocksplitting = 1;
   options->blocksplittinglast = 0;
   options->blocksplittingmax = 15;
+  options->masterblocksize = MASTER_BLOCK_SIZE;
+  options->cachedlengths = NUM_CACHED_LENGTHS;
+  options->cachememory = 0;
+  options->chainhits = MAX_CHAIN_HITS;
+  options->samehash = USE_HASH_SAME_HASH;
+  options->shortcutrepetitions = SHORTCUT_LONG_REPETITIONS;
+  options->lazymatching = LAZY_MATCHING;
+  options->rowstride = 0;
+  options->pixelsize = 0;
+  options->binarytree = 0;
+  options->hash4 = 0;
+  options->convergenceiterations = 0;
+  options->convergencethreshold = 0.0001;
+  options->costprofile = 0;
+  options->blocktimelimit = 0;
+  options->filetimelimit = 0;
+  options->filedeadline = 0;
+  options->stats = 0;
+  options->progress = 0;
+  options->progresscontext = 0;
+  options->output = 0;
+  options->outputcontext = 0;
+  options->progressstate = 0;
+  options->randomstate = 0;
+  options->allocator = 0;
+  options->arena = 0;
+}
+
+void InitRandomState(RandomState* state) {
+  state->m_w = 1;
+  state->m_z = 2;
+}
+
+double GetSeconds(void) {
+#ifdef _WIN32
+  return GetTickCount() / 1000.0;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+int ReportProgress(const Options* options, double done) {
+  ProgressState* state = options->progressstate;
+  if (!state) return 0;
+  state->done = done;
+  if (options->progress && !state->cancelled) {
+    double fraction = state->insize == 0 ? 1 : done / state->insize;
+    state->cancelled = options->progress(fraction, options->progresscontext);
+  }
+  return state->cancelled;
+}
+
+int PollProgress(const Options* options) {
+  if (!options->progressstate) return 0;
+  return ReportProgress(options, options->progressstate->done);
+}
+
+int AppendBytes(const unsigned char* bytes, size_t amount,
+                unsigned char** data, size_t* size) {
+  size_t i;
+  for (i = 0; i < amount; i++) {
+    if (!((*size) & ((*size) - 1))) {
+      /* Double the allocation size if the size is a power of two. */
+      unsigned char* grown = (unsigned char*)((*size) == 0
+          ? malloc(1) : realloc(*data, (*size) * 2));
+      if (!grown) return 1;
+      *data = grown;
+    }
+    (*data)[(*size)++] = bytes[i];
+  }
+  return 0;
 }
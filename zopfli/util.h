@@ -52,6 +52,7 @@ The whole compression algorithm, including the smarter block splitting, will
 be executed independently on each huge block.
 Dividing into huge blocks hurts compression, but not much relative to the size.
 Set this to, for example, 20MB (20000000). Set it to 0 to disable master blocks.
+This is the default of Options.masterblocksize.
 */
 #define MASTER_BLOCK_SIZE 20000000
 
@@ -65,7 +66,7 @@ For longest match cache. max 256. Uses huge amounts of memory but makes it
 faster. Uses this many times three bytes per single byte of the input data.
 This is so because longest match finding has to find the exact distance
 that belongs to each length for the best lz77 strategy.
-Good values: e.g. 5, 8.
+Good values: e.g. 5, 8. This is the default of Options.cachedlengths.
 */
 #define NUM_CACHED_LENGTHS 8
 
@@ -75,7 +76,7 @@ on files where the hash value is the same very often. On these files, this
 gives worse compression (the value should ideally be 32768, which is the
 WINDOW_SIZE, while zlib uses 4096 even for best level), but makes it faster on
 some specific files.
-Good value: e.g. 8192.
+Good value: e.g. 8192. This is the default of Options.chainhits.
 */
 #define MAX_CHAIN_HITS 8192
 
@@ -88,7 +89,7 @@ consumes a lot of memory but speeds it up. No effect on compression size.
 /*
 Enable to remember amount of successive identical bytes in the hash chain for
 finding longest match
-required for USE_HASH_SAME_HASH and SHORTCUT_LONG_REPETITIONS
+required for Options.samehash and Options.shortcutrepetitions
 This has no effect on the compression result, and enabling it increases speed.
 */
 #define USE_HASH_SAME
@@ -99,22 +100,38 @@ best length so far is long enough. This is way faster for files with lots of
 identical bytes, on which the compressor is otherwise too slow. Regular files
 are unaffected or maybe a tiny bit slower.
 This has no effect on the compression result, only on speed.
+This is the default of Options.samehash.
 */
-#define USE_HASH_SAME_HASH
+#define USE_HASH_SAME_HASH 1
 
 /*
 Enable this, to avoid slowness for files which are a repetition of the same
 character more than a multiple of MAX_MATCH times. This should not affect the
 compression result.
+This is the default of Options.shortcutrepetitions.
 */
-#define SHORTCUT_LONG_REPETITIONS
+#define SHORTCUT_LONG_REPETITIONS 1
 
 /*
 Whether to use lazy matching in the greedy LZ77 implementation. This gives a
 better result of LZ77Greedy, but the effect this has on the optimal LZ77
 varies from file to file.
+This is the default of Options.lazymatching.
 */
-#define LAZY_MATCHING
+#define LAZY_MATCHING 1
+
+/*
+Makes the compiler inline a static function into every caller. Used for the
+kernels that are called with constant switches, so that each caller gets a copy
+specialized for its values.
+*/
+#if defined(__GNUC__)
+#define FORCE_INLINE __inline__ __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define FORCE_INLINE __forceinline
+#else
+#define FORCE_INLINE
+#endif
 
 /*
 Gets the symbol for the given length, cfr. the DEFLATE spec.
@@ -137,6 +154,110 @@ int GetDistExtraBits(int dist);
 /* Gets value of the extra bits for the given dist, cfr. the DEFLATE spec. */
 int GetDistExtraBitsValue(int dist);
 
+/*
+How far the compression got before a time limit ran out. Later stages have
+lower values, so that the zero value means everything was done.
+*/
+typedef enum CompressionStage {
+  /* All blocks did their iterations, or stopped once they converged. */
+  STAGE_COMPLETE,
+  /* All blocks were optimized, but some not for as long as wanted. */
+  STAGE_PARTIAL,
+  /* Some blocks only have the greedy LZ77 result, without any iteration. */
+  STAGE_GREEDY,
+  /* The progress or output function cancelled the compression, so the output
+  is incomplete. */
+  STAGE_CANCELLED
+} CompressionStage;
+
+/*
+Statistics about a compression, filled in while compressing.
+*/
+typedef struct CompressionStats {
+  /* Amount of blocks that were optimized with LZ77Optimal. */
+  int blocks;
+
+  /* Amount of LZ77Optimal iterations actually done over all those blocks. */
+  int iterations;
+
+  /*
+  Amount of those blocks that went on from Options.costprofile instead of from
+  a greedy LZ77 run, because the first run from the profile came out smaller.
+  */
+  int warmblocks;
+
+  /* The stage reached by the least optimized block. */
+  CompressionStage stage;
+
+  /* Most working memory taken from the allocator at once, in bytes. */
+  size_t peakmemory;
+
+  /* Longest match cache lookups, and how many of them it could answer. */
+  size_t cachelookups;
+  size_t cachehits;
+
+  /* Hash chain entries visited by the match finder. A double, since it easily
+  exceeds 32 bits. */
+  double chainsteps;
+} CompressionStats;
+
+/*
+Symbol frequencies of earlier compressed data, as a starting cost model for
+LZ77Optimal, see Options.costprofile. All zero while empty.
+*/
+typedef struct CostProfile {
+  size_t litlens[288];  /* Frequencies of the lit/len symbols. */
+  size_t dists[32];  /* Frequencies of the dist symbols. */
+} CostProfile;
+
+/*
+Allocator for all memory a compression job works with, see Options.allocator.
+allocate: returns size bytes of memory, or 0 when out of memory.
+deallocate: frees memory returned by allocate.
+context: passed to both functions.
+*/
+typedef struct Allocator {
+  void* (*allocate)(size_t size, void* context);
+  void (*deallocate)(void* ptr, void* context);
+  void* context;
+} Allocator;
+
+/*
+Callback for progress reports.
+fraction: the part of the input that is done so far, from 0 to 1.
+context: the progresscontext from the options.
+Returns non-zero to cancel the compression.
+*/
+typedef int ProgressFun(double fraction, void* context);
+
+/*
+Callback that receives the finished output, see Options.output.
+data: the next size bytes of the output.
+context: the outputcontext from the options.
+Returns non-zero to cancel the compression, for example when writing failed.
+*/
+typedef int OutputFun(const unsigned char* data, size_t size, void* context);
+
+/*
+Progress of a Deflate call, shared by all of its blocks.
+*/
+typedef struct ProgressState {
+  size_t insize;  /* Size of the whole input of the Deflate call. */
+  double done;  /* Amount of input bytes done, as last reported. */
+  int cancelled;  /* Whether the progress callback asked to stop. */
+} ProgressState;
+
+/*
+State of the random number generator with which LZ77Optimal varies the
+statistics once they stop improving. It is kept for a whole Deflate call, rather
+than for the program, so that the output does not depend on what was compressed
+before it or at the same time in other threads.
+*/
+typedef struct RandomState {
+  unsigned int m_w;
+  unsigned int m_z;
+} RandomState;
+
 /*
 Options used throughout the program.
 */
@@ -171,11 +292,189 @@ typedef struct Options {
   extreme results that hurt compression on some files). Default value: 15.
   */
   int blocksplittingmax;
+
+  /*
+  Size of the master blocks the input is divided into, 0 for none. Default:
+  MASTER_BLOCK_SIZE.
+  */
+  size_t masterblocksize;
+
+  /*
+  Amount of lengths per position in the longest match cache, at most 256, 0 to
+  only cache the longest match. Default: NUM_CACHED_LENGTHS.
+  */
+  int cachedlengths;
+
+  /*
+  Maximum size in bytes of the longest match cache of a block, 0 for no limit.
+  A full cache takes 4 + 3 * cachedlengths bytes per input byte. Over the limit,
+  fewer lengths are cached per position, and if even that does not fit, only
+  the start of the block is cached. See the cache counters of the stats for the
+  effect on the hit rate. Default: 0.
+  */
+  size_t cachememory;
+
+  /* Most hash chain hits per match search. Default: MAX_CHAIN_HITS. */
+  int chainhits;
+
+  /*
+  Match finder and greedy LZ77 switches, see USE_HASH_SAME_HASH,
+  SHORTCUT_LONG_REPETITIONS and LAZY_MATCHING for what they do and for their
+  defaults. samehash and shortcutrepetitions only take effect if USE_HASH_SAME
+  is defined. The match finder is specialized for each combination once per
+  block, so these do not cost anything inside its loops.
+  */
+  int samehash;
+  int shortcutrepetitions;
+  int lazymatching;
+
+  /*
+  Layout of image data, such as filtered PNG scanlines, as hints for the match
+  finder. rowstride is the size of a row in bytes, including the filter byte,
+  and pixelsize the size of a pixel in bytes. If rowstride is not 0, the match
+  finder first tries the distances of the pixel to the left and of the pixels
+  above, and only walks the hash chain for longer matches. This walks much
+  less of the chains, but a shorter distance for the same length found later
+  in the chain is then missed, so the output can differ slightly. Default: 0,
+  no hints.
+  */
+  size_t rowstride;
+  size_t pixelsize;
+
+  /*
+  If not 0, finds matches with a binary tree of the window instead of with hash
+  chains. For every length it finds the nearest match, visiting about log2 of
+  the window in nodes rather than every earlier occurance of the hash, so it
+  does not run into chainhits on repetitive data. chainhits then limits the
+  depth of the tree walk. Like the hash chains, it returns the nearest match
+  for every length, so the output is byte-identical to theirs as long as the
+  chains stay under chainhits. Only on data where they run into it, such as
+  long repetitive stretches, can the output differ slightly. rowstride is not
+  used with it. Default: 0.
+  */
+  int binarytree;
+
+  /*
+  If not 0, the hash chains hash the next 4 bytes with a multiplicative hash,
+  instead of shifting in one byte at a time of the next 3. Fewer unrelated
+  strings end up in the same chain, so the chains are walked faster, but a
+  match of only 3 bytes is then found only through hash collisions. The output
+  differs. Default: 0, the output of the original hash.
+  */
+  int hash4;
+
+  /*
+  If larger than 0, stops iterating on a block once the iterations converged:
+  when the best cost found improved by less than convergencethreshold (relative
+  to the cost) during the last convergenceiterations iterations. numiterations
+  stays the maximum. Default: 0, always do numiterations iterations. Good
+  values: 5 and 0.0001.
+  */
+  int convergenceiterations;
+  double convergencethreshold;
+
+  /*
+  If not null, LZ77Optimal also tries a first run from the cost model of this
+  profile, unless the profile is still empty, and goes on from it rather than
+  from the statistics of a greedy LZ77 run if that run comes out smaller.
+  Afterwards it stores the statistics of the result of the block in the
+  profile. The next block, or the next file compressed with the same profile,
+  then starts from those. Neighbouring blocks and images from the same source
+  tend to have similar statistics, so this usually saves some iterations,
+  mostly together with convergenceiterations. A profile that does not fit costs
+  one run. The output differs. Default: 0.
+  */
+  CostProfile* costprofile;
+
+  /*
+  Wall clock time limits, in seconds, for the iterations of a single block and
+  for all the iterations of one Deflate call. Once a limit is reached, the best
+  result found so far is used: the greedy LZ77 result for blocks that did not
+  get to iterate at all. The output is always valid, see stats for how far it
+  got. Default: 0, no limit.
+  */
+  double blocktimelimit;
+  double filetimelimit;
+
+  /*
+  Time, as given by GetSeconds, at which filetimelimit runs out, or 0. This is
+  set by Deflate, there is no need to fill it in.
+  */
+  double filedeadline;
+
+  /* If not null, the statistics of the compression are added to this. */
+  CompressionStats* stats;
+
+  /*
+  If not null, called at block and iteration boundaries with the progress of
+  the compression. When it returns non-zero, the compression stops as soon as
+  possible and frees all its memory. Deflate, ZlibCompress and GzipCompress
+  then return 2, the stats get STAGE_CANCELLED, and the output is incomplete and
+  must be discarded.
+  */
+  ProgressFun* progress;
+  void* progresscontext;
+
+  /*
+  If not null, each deflate block is passed to this function as soon as it is
+  written, together with everything before it in the output array, and removed
+  from the array. The array then holds at most one block at a time, and only
+  the last partially filled byte in between, which Deflate leaves there for the
+  next block. ZlibCompress and GzipCompress pass on their header and trailer
+  too, so that they leave the array empty. When the function returns non-zero,
+  the compression is cancelled, as by the progress function: no more blocks
+  and no trailer are passed on. Default: 0.
+  */
+  OutputFun* output;
+  void* outputcontext;
+
+  /* Set by Deflate, there is no need to fill it in. */
+  ProgressState* progressstate;
+
+  /* Set by Deflate, there is no need to fill it in. */
+  RandomState* randomstate;
+
+  /*
+  Where the working memory of a compression comes from. Deflate takes it in
+  large chunks for an arena, which is given back at once when it is done. If
+  the allocator runs out of memory, the compression fails with an error rather
+  than ending the program. Default: 0, use malloc and free.
+  */
+  const Allocator* allocator;
+
+  /* The arena of the Deflate call. Set by Deflate, no need to fill it in. */
+  struct Arena* arena;
 } Options;
 
 /* Initializes options with default values. */
 void InitOptions(Options* options);
 
+/* Starts the random number generator at its fixed seed. */
+void InitRandomState(RandomState* state);
+
+/* Returns wall clock time in seconds, counted from an arbitrary moment. */
+double GetSeconds(void);
+
+/*
+Reports that done bytes of the input of the Deflate call are finished to the
+progress callback, if any. Returns whether the compression was cancelled.
+*/
+int ReportProgress(const Options* options, double done);
+
+/*
+Gives the progress callback a chance to cancel, without progress since the last
+report. Returns whether the compression was cancelled.
+*/
+int PollProgress(const Options* options);
+
+/*
+Appends the bytes to the dynamic array, growing it the same way as APPEND_DATA.
+Returns 1 if out of memory, in which case the array is left as it was, 0
+otherwise.
+*/
+int AppendBytes(const unsigned char* bytes, size_t amount,
+                unsigned char** data, size_t* size);
+
 /*
 Appends value to dynamically allocated memory, doubling its allocation size
 whenever needed.
@@ -46,7 +46,7 @@ static unsigned adler32(const unsigned char* data, size_t size)
   return (s2 << 16) | s1;
 }
 
-void ZlibCompress(const Options* options,
+int ZlibCompress(const Options* options,
                   const unsigned char* in, size_t insize,
                   unsigned char** out, size_t* outsize) {
   unsigned char bitpointer = 0;
@@ -56,23 +56,34 @@ void ZlibCompress(const Options* options,
   unsigned fdict = 0;
   unsigned cmfflg = 256 * cmf + fdict * 32 + flevel * 64;
   unsigned fcheck = 31 - cmfflg % 31;
+  unsigned char header[2];
+  unsigned char trailer[4];
+  int error;
   cmfflg += fcheck;
 
-  APPEND_DATA(cmfflg / 256, out, outsize);
-  APPEND_DATA(cmfflg % 256, out, outsize);
-
-  Deflate(options, 2 /* dynamic block */, 1 /* final */,
-      in, insize, &bitpointer, out, outsize);
-
-  APPEND_DATA((checksum >> 24) % 256, out, outsize);
-  APPEND_DATA((checksum >> 16) % 256, out, outsize);
-  APPEND_DATA((checksum >> 8) % 256, out, outsize);
-  APPEND_DATA(checksum % 256, out, outsize);
+  header[0] = cmfflg / 256;
+  header[1] = cmfflg % 256;
+  if (AppendBytes(header, sizeof(header), out, outsize)) return 1;
+
+  error = Deflate(options, 2 /* dynamic block */, 1 /* final */,
+                  in, insize, &bitpointer, out, outsize);
+  if (error) return error;
+
+  trailer[0] = (checksum >> 24) % 256;
+  trailer[1] = (checksum >> 16) % 256;
+  trailer[2] = (checksum >> 8) % 256;
+  trailer[3] = checksum % 256;
+  if (AppendBytes(trailer, sizeof(trailer), out, outsize)) return 1;
+  if (FlushOutput(options, 0, out, outsize)) {
+    if (options->stats) options->stats->stage = STAGE_CANCELLED;
+    return 2;
+  }
 
-  if (options->verbose) {
+  if (options->verbose && !options->output) {
     fprintf(stderr,
             "Original Size: %d, Compressed: %d, Compression: %f%% Removed\n",
             (int)insize, (int)*outsize,
             100.0f * (float)(insize - *outsize) / (float)insize);
   }
+  return 0;
 }
@@ -34,8 +34,10 @@ options: global program options
 out: pointer to the dynamic output array to which the result is appended. Must
   be freed after use.
 outsize: pointer to the dynamic output array size.
+returns 0 on success, 1 if out of memory, or 2 if cancelled, see Deflate. The
+  trailer is only added on success.
 */
-void ZlibCompress(const Options* options,
+int ZlibCompress(const Options* options,
                   const unsigned char* in, size_t insize,
                   unsigned char** out, size_t* outsize);
 
@@ -76,6 +76,46 @@ static void SaveFile(const char* filename,
   fclose(file);
 }
 
+/*
+Loads a cost profile saved by SaveCostProfile. Leaves the profile empty if the
+file does not exist or is not a complete profile.
+*/
+static void LoadCostProfile(const char* filename, CostProfile* profile) {
+  FILE* file = fopen(filename, "r");
+  unsigned long value;
+  size_t i;
+  int ok = 1;
+
+  memset(profile, 0, sizeof(*profile));
+  if (!file) return;
+  for (i = 0; i < 288 + 32 && ok; i++) {
+    ok = fscanf(file, "%lu", &value) == 1;
+    if (i < 288) profile->litlens[i] = value;
+    else profile->dists[i - 288] = value;
+  }
+  if (!ok) memset(profile, 0, sizeof(*profile));
+  fclose(file);
+}
+
+/*
+Saves a cost profile as text, the lit/len frequencies followed by the dist
+frequencies, overwriting the file if it existed.
+*/
+static void SaveCostProfile(const char* filename, const CostProfile* profile) {
+  FILE* file = fopen(filename, "w");
+  size_t i;
+  if (!file) {
+    fprintf(stderr, "Could not save profile: %s\n", filename);
+    return;
+  }
+  for (i = 0; i < 288 + 32; i++) {
+    fprintf(file, "%lu%c", (unsigned long)(i < 288 ? profile->litlens[i]
+                                                   : profile->dists[i - 288]),
+            i % 16 == 15 ? '\n' : ' ');
+  }
+  fclose(file);
+}
+
 typedef enum {
   OUTPUT_GZIP,
   OUTPUT_ZLIB,
@@ -93,21 +133,61 @@ void CompressFile(const Options* options,
   size_t insize;
   unsigned char* out = 0;
   size_t outsize = 0;
+  Options fileoptions = *options;
+  CompressionStats stats;
+  int error = 0;
+  stats.blocks = 0;
+  stats.iterations = 0;
+  stats.warmblocks = 0;
+  stats.stage = STAGE_COMPLETE;
+  stats.peakmemory = 0;
+  stats.cachelookups = 0;
+  stats.cachehits = 0;
+  stats.chainsteps = 0;
+  fileoptions.stats = &stats;
+  options = &fileoptions;
   LoadFile(infilename, &in, &insize);
   if (insize == 0) {
     fprintf(stderr, "Invalid filename: %s\n", infilename);
     return;
   }
   if (output_type == OUTPUT_GZIP) {
-    GzipCompress(options, in, insize, &out, &outsize);
+    error = GzipCompress(options, in, insize, &out, &outsize);
   } else if (output_type == OUTPUT_ZLIB) {
-    ZlibCompress(options, in, insize, &out, &outsize);
+    error = ZlibCompress(options, in, insize, &out, &outsize);
   } else if (output_type == OUTPUT_DEFLATE) {
     unsigned char bp = 0;
-    Deflate(options, 2 /* Dynamic block */, 1, in, insize, &bp, &out, &outsize);
+    error = Deflate(options, 2 /* Dynamic block */, 1, in, insize,
+                    &bp, &out, &outsize);
   } else {
     assert(0);
   }
+  if (error) {
+    fprintf(stderr, "%s: %s\n", error == 2 ? "Cancelled" : "Out of memory",
+            infilename);
+    free(out);
+    free(in);
+    return;
+  }
+  if (options->verbose) {
+    static const char* stagenames[4] = {
+      "complete", "partial", "greedy", "cancelled"
+    };
+    fprintf(stderr, "Iterations: %d in %d blocks, stage: %s\n",
+            stats.iterations, stats.blocks, stagenames[stats.stage]);
+    if (options->costprofile) {
+      fprintf(stderr, "Started from the cost profile: %d blocks\n",
+              stats.warmblocks);
+    }
+    fprintf(stderr, "Peak working memory: %d KiB\n",
+            (int)(stats.peakmemory / 1024));
+    fprintf(stderr, "Hash chain steps: %.0f\n", stats.chainsteps);
+    if (stats.cachelookups > 0) {
+      fprintf(stderr, "Match cache hit rate: %.1f%% of %lu lookups\n",
+              100.0 * stats.cachehits / stats.cachelookups,
+              (unsigned long)stats.cachelookups);
+    }
+  }
   if (outfilename) {
     SaveFile(outfilename, out, outsize);
   } else {
@@ -138,14 +218,27 @@ static char StringsEqual(const char* str1, const char* str2) {
   return strcmp(str1, str2) == 0;
 }
 
+/*
+Returns the part of str after prefix, or 0 if str does not start with prefix.
+Used for options of the form --name=value.
+*/
+static const char* SkipPrefix(const char* str, const char* prefix) {
+  size_t len = strlen(prefix);
+  return strncmp(str, prefix, len) == 0 ? str + len : 0;
+}
+
 int main(int argc, char* argv[]) {
   Options options;
+  CostProfile profile;
+  const char* profilename = 0;
   const char* filename = 0;
+  const char* value;
   int output_to_stdout = 0;
   int i;
   OutputType output_type = OUTPUT_GZIP;
 
   InitOptions(&options);
+  memset(&profile, 0, sizeof(profile));
 
   for (i = 1; i < argc; i++) {
     if (StringsEqual(argv[i], "-v")) options.verbose = 1;
@@ -162,6 +255,58 @@ int main(int argc, char* argv[]) {
     else if (StringsEqual(argv[i], "--i250")) options.numiterations = 250;
     else if (StringsEqual(argv[i], "--i500")) options.numiterations = 500;
     else if (StringsEqual(argv[i], "--i1000")) options.numiterations = 1000;
+    else if ((value = SkipPrefix(argv[i], "--converge="))) {
+      options.convergenceiterations = atoi(value);
+    }
+    else if ((value = SkipPrefix(argv[i], "--blocktime="))) {
+      options.blocktimelimit = atof(value);
+    }
+    else if ((value = SkipPrefix(argv[i], "--filetime="))) {
+      options.filetimelimit = atof(value);
+    }
+    else if ((value = SkipPrefix(argv[i], "--masterblock="))) {
+      options.masterblocksize = (size_t)atol(value);
+    }
+    else if ((value = SkipPrefix(argv[i], "--cachedlengths="))) {
+      options.cachedlengths = atoi(value);
+      if (options.cachedlengths < 0) options.cachedlengths = 0;
+      if (options.cachedlengths > 256) options.cachedlengths = 256;
+    }
+    else if ((value = SkipPrefix(argv[i], "--cachememory="))) {
+      options.cachememory = (size_t)atol(value) * 1024 * 1024;
+    }
+    else if ((value = SkipPrefix(argv[i], "--chainhits="))) {
+      options.chainhits = atoi(value);
+      if (options.chainhits < 1) options.chainhits = 1;
+    }
+    else if ((value = SkipPrefix(argv[i], "--samehash="))) {
+      options.samehash = atoi(value);
+    }
+    else if ((value = SkipPrefix(argv[i], "--shortcut="))) {
+      options.shortcutrepetitions = atoi(value);
+    }
+    else if ((value = SkipPrefix(argv[i], "--lazy="))) {
+      options.lazymatching = atoi(value);
+    }
+    else if ((value = SkipPrefix(argv[i], "--rowstride="))) {
+      options.rowstride = (size_t)atol(value);
+    }
+    else if ((value = SkipPrefix(argv[i], "--pixelsize="))) {
+      options.pixelsize = (size_t)atol(value);
+    }
+    else if ((value = SkipPrefix(argv[i], "--binarytree="))) {
+      options.binarytree = atoi(value);
+    }
+    else if ((value = SkipPrefix(argv[i], "--hash4="))) {
+      options.hash4 = atoi(value);
+    }
+    else if ((value = SkipPrefix(argv[i], "--warmstart="))) {
+      options.costprofile = atoi(value) ? &profile : 0;
+    }
+    else if ((value = SkipPrefix(argv[i], "--profile="))) {
+      profilename = value;
+      options.costprofile = &profile;
+    }
     else if (StringsEqual(argv[i], "-h")) {
       fprintf(stderr, "Usage: zopfli [OPTION]... FILE\n"
           "  -h    gives this help\n"
@@ -180,10 +325,34 @@ int main(int argc, char* argv[]) {
           "  --i250  more compression, but slower\n"
           "  --i500  more compression, but slower\n"
           "  --i1000  more compression, but slower\n");
+      fprintf(stderr, "  --converge=N  stop iterating a block once N"
+          " iterations gave no significant gain\n"
+          "  --blocktime=S  stop iterating a block after S seconds\n"
+          "  --filetime=S  stop iterating a file after S seconds\n");
+      fprintf(stderr, "  --masterblock=N  compress in independent parts of N"
+          " bytes, 0 for one part\n"
+          "  --cachedlengths=N  lengths per byte in the match cache (0-256)\n"
+          "  --cachememory=N  limit the match cache of a block to N MiB\n"
+          "  --chainhits=N  maximum hash chain hits per match search\n"
+          "  --samehash=0|1  second hash for repeated bytes\n"
+          "  --shortcut=0|1  skip over long repetitions of a byte\n"
+          "  --lazy=0|1  lazy matching in the greedy LZ77 pass\n");
+      fprintf(stderr, "  --rowstride=N  try the distance of the row above"
+          " first, for image data\n"
+          "  --pixelsize=N  bytes per pixel, with --rowstride\n"
+          "  --binarytree=0|1  find matches with a binary tree instead of"
+          " hash chains\n"
+          "  --hash4=0|1  hash 4 bytes instead of 3 for the hash chains\n");
+      fprintf(stderr, "  --warmstart=0|1  start each block from the"
+          " statistics of the previous one\n"
+          "  --profile=FILE  --warmstart=1, and load the statistics from and"
+          " save them to FILE\n");
       return 0;
     }
   }
 
+  if (profilename) LoadCostProfile(profilename, &profile);
+
   for (i = 1; i < argc; i++) {
     if (argv[i][0] != '-') {
       char* outfilename;
@@ -210,6 +379,8 @@ int main(int argc, char* argv[]) {
   if (!filename) {
     fprintf(stderr,
             "Please provide filename\nFor help, type: %s -h\n", argv[0]);
+  } else if (profilename) {
+    SaveCostProfile(profilename, &profile);
   }
 
   return 0;